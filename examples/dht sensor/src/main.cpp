@@ -53,7 +53,29 @@ DHT dht(DHTPIN, DHT22);
 
 Maison maison(Maison::WATCHDOG_24H);
 
-long period_start;
+// Run by the framework every WAIT_TIME milliseconds
+
+void read_dht()
+{
+  //sensors_event_t event;
+
+  float humidity    = dht.readHumidity();
+  float temperature = dht.readTemperature();
+
+  PRINT("Temperature: "); PRINTLN(temperature);
+  PRINT("Humidity: ");    PRINTLN(humidity);
+
+  char buff[50];
+  snprintf(buff, 50, "{\"T\":%4.1f,\"H\":%4.1f}", temperature, humidity);
+
+  maison.send_msg(
+    MAISON_CTRL_TOPIC, 
+    F("{\"device\":\"%s\""
+      ",\"msg_type\":\"DHT_DATA\""
+      ",\"content\":%s}"),
+    maison.get_device_name(),
+    buff);
+}
 
 void setup() 
 {
@@ -62,33 +84,10 @@ void setup()
   
   dht.begin();
   maison.setup();
-  period_start = millis();
+  maison.add_task(read_dht, WAIT_TIME, WAIT_TIME + maison.report_phase(WAIT_TIME));
 }
 
 void loop() 
 {
   maison.loop();
-
-  if ((millis() - period_start) > WAIT_TIME) {
-    period_start = millis();
-
-    //sensors_event_t event;
-
-    float humidity    = dht.readHumidity();
-    float temperature = dht.readTemperature();
-
-    PRINT("Temperature: "); PRINTLN(temperature);
-    PRINT("Humidity: ");    PRINTLN(humidity);
-
-    char buff[50];
-    snprintf(buff, 50, "{\"T\":%4.1f,\"H\":%4.1f}", temperature, humidity);
-
-    maison.send_msg(
-      MAISON_CTRL_TOPIC, 
-      F("{\"device\":\"%s\""
-        ",\"msg_type\":\"DHT_DATA\""
-        ",\"content\":%s}"),
-      maison.get_device_name(),
-      buff);
-  }
 }
\ No newline at end of file
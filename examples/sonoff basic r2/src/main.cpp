@@ -53,8 +53,6 @@
   #define WALL_SWITCH 1  // Normal wall switch
 #endif
 
-#define MAX_DEBOUNCE_COUNT 3
-
 #define LED_ON  digitalWrite(LED, LOW )
 #define LED_OFF digitalWrite(LED, HIGH)
 
@@ -66,12 +64,12 @@
 
 #define ON_AT_STARTUP 0
 
-Maison maison(Maison::WATCHDOG_24H);
+// The device waits in WiFi light sleep between loop() calls. It is woken
+// up by the switch or by received messages.
+
+Maison maison(Maison::WATCHDOG_24H | Maison::LIGHT_SLEEP);
 
 bool relay_is_on;
-bool switch_state;
-bool switch_new_state;
-byte switch_new_state_count;
 
 void send_relay_state()
 {
@@ -123,8 +121,10 @@ void setup()
 
   maison.setup();
 
-  switch_state = digitalRead(SWITCH) == LOW;
-  switch_new_state_count = 0;
+  // The switch changes are captured through interrupts and debounced
+  // by the framework. They are not used as finite state machine events.
+
+  maison.add_input(SWITCH, true, false);
 
   maison.set_msg_callback(sonoff_callback, RELAY_TOPIC, 0);
 }
@@ -133,32 +133,20 @@ void loop()
 {
   maison.loop();
 
-  bool new_state = digitalRead(SWITCH) == LOW;
-
-  if (new_state != switch_state) {
-    if (new_state != switch_new_state) {
-      switch_new_state_count = 0;
-      switch_new_state       = new_state;
-    }
-    if (++switch_new_state_count > MAX_DEBOUNCE_COUNT) {
-      // We have a new switch state. Toggle the relay...
-      switch_state = switch_new_state;
-      #if WALL_SWITCH
+  Maison::InputEvent event;
+
+  while (maison.get_input_event(event)) {
+    // We have a new switch state. Toggle the relay...
+    #if WALL_SWITCH
+      RELAY_TOGGLE;
+      send_relay_state();
+      SHOW_RELAY;
+    #else
+      if (event.active) {
         RELAY_TOGGLE;
         send_relay_state();
         SHOW_RELAY;
-      #else
-        if (switch_state) {
-          RELAY_TOGGLE;
-          send_relay_state();
-          SHOW_RELAY;
-        }
-      #endif
-    }
+      }
+    #endif
   }
-  else {
-    switch_new_state = switch_state;
-  }
-
-  delay(100);
 }
@@ -1,13 +1,99 @@
 #include <Maison.h>
+#include <core_version.h>
 
 // Used by the maison_callback friend function
 static Maison * maison;
 
+// The JSON document lent to the functions parsing or building JSON content,
+// instead of allocating one on the heap for each message. Only one of
+// them may use it at a time.
+
+static StaticJsonDocument<MAISON_JSON_DOC_SIZE> json_doc;
+
+static JsonDocument & get_json_doc()
+{
+  json_doc.clear();
+  return json_doc;
+}
+
+// The scratch arena shared by the framework to format the messages and to
+// read or write the config file (scratch_text), and to build topic and
+// client names (scratch_topic). Only one function may use each part at a
+// time.
+
+#define SCRATCH_TOPIC_SIZE 80
+#define SCRATCH_TEXT_SIZE  (MAISON_SCRATCH_SIZE - SCRATCH_TOPIC_SIZE)
+
+static_assert(MAISON_SCRATCH_SIZE >= 512, "MAISON_SCRATCH_SIZE must be at least 512");
+
+static char   scratch[MAISON_SCRATCH_SIZE];
+static char * const scratch_text  = scratch;
+static char * const scratch_topic = &scratch[SCRATCH_TEXT_SIZE];
+
+// Heap telemetry reported in the state and heap messages. The low-water
+// mark is sampled at each loop() and after the framework allocations, 
+// which are counted. Sampling only reads the free heap counter. The counted
+// allocations are the MQTT connection attempts (the network client
+// allocates its buffers when connecting) and the OTA update starts.
+//
+// The largest free block is a uint32_t from core 3.0, the uint16_t version
+// of ESP.getHeapStats() being deprecated.
+
+#if defined(ARDUINO_ESP8266_MAJOR) && (ARDUINO_ESP8266_MAJOR >= 3)
+  typedef uint32_t heap_block_t;
+#else
+  typedef uint16_t heap_block_t;
+#endif
+
+static uint32_t heap_low_water = 0xFFFFFFFF;
+static uint16_t heap_alloc_count = 0;
+
+static void sample_heap()
+{
+  uint32_t free_heap = ESP.getFreeHeap();
+  if (free_heap < heap_low_water) heap_low_water = free_heap;
+}
+
+static void count_heap_alloc()
+{
+  heap_alloc_count++;
+  sample_heap();
+}
+
+// The elapsed time of a loop is saturated, as Deep Sleep periods may be
+// chained beyond what it can hold and last_loop_duration() returns a long.
+
+static uint32_t add_elapse_time(uint32_t _elapse_time, uint64_t _more)
+{
+  uint64_t sum = (uint64_t) _elapse_time + _more;
+  return (sum > 0x7FFFFFFFU) ? 0x7FFFFFFFU : (uint32_t) sum;
+}
+
+#define MAISON_STR_(x) #x
+#define MAISON_STR(x)  MAISON_STR_(x)
+
+#if MAISON_MEMORY_REPORT
+  #pragma message "Maison static RAM: scratch arena     " MAISON_STR(MAISON_SCRATCH_SIZE) " bytes (" MAISON_STR(SCRATCH_TOPIC_SIZE) " for topic names)"
+  #pragma message "Maison static RAM: JSON document     " MAISON_STR(MAISON_JSON_DOC_SIZE) " bytes"
+  #pragma message "Maison static RAM: PubSubClient buf. " MAISON_STR(MQTT_MAX_PACKET_SIZE) " bytes"
+  #if MQTT_OTA
+    #pragma message "Maison static RAM: topic names       2 x " MAISON_STR(MAISON_TOPIC_SIZE) " + " MAISON_STR(MAISON_OTA_TOPIC_SIZE) " bytes"
+  #else
+    #pragma message "Maison static RAM: topic names       2 x " MAISON_STR(MAISON_TOPIC_SIZE) " bytes"
+  #endif
+#endif
+
+#ifdef MAISON_RAM_BUDGET
+  static_assert(sizeof(Maison) + sizeof(scratch) + sizeof(json_doc) <= MAISON_RAM_BUDGET,
+                "Maison static RAM exceeds MAISON_RAM_BUDGET");
+#endif
+
 Maison::Maison() :
                wifi_client(NULL),
     last_reconnect_attempt(0),
        connect_retry_count(0),
        first_connect_trial(true),
+              stayed_awake(false),
              user_callback(NULL),
             user_sub_topic(NULL),
                   user_qos(0),
@@ -18,9 +104,27 @@ Maison::Maison() :
   counting_lost_connection(true),
    wait_for_ota_completion(false),
                 reboot_now(false),
+          reconnect_needed(CONFIG_UNCHANGED),
                restart_now(false)
+  #if MQTT_OTA
+        , ota_chunk_count(0),
+           ota_chunk_size(0),
+           ota_next_chunk(0),
+        ota_chunk_retries(0)
+  #endif
 {
   maison = this;
+  memset(tasks, 0, sizeof(tasks));
+  #if MAISON_SAMPLING
+    sampler = NULL;
+  #endif
+  #if MAISON_INPUTS > 0
+    input_count      = 0;
+    input_event_head = input_event_tail = 0;
+  #endif
+  #if MAISON_EVENT_CHANNELS > 0
+    memset(channel_process, 0, sizeof(channel_process));
+  #endif
 }
 
 Maison::Maison(uint8_t _feature_mask) :
@@ -28,6 +132,7 @@ Maison::Maison(uint8_t _feature_mask) :
     last_reconnect_attempt(0),
        connect_retry_count(0),
        first_connect_trial(true),
+              stayed_awake(false),
              user_callback(NULL),
             user_sub_topic(NULL),
                   user_qos(0),
@@ -38,9 +143,27 @@ Maison::Maison(uint8_t _feature_mask) :
   counting_lost_connection(true),
    wait_for_ota_completion(false),
                 reboot_now(false),
+          reconnect_needed(CONFIG_UNCHANGED),
                restart_now(false)
+  #if MQTT_OTA
+        , ota_chunk_count(0),
+           ota_chunk_size(0),
+           ota_next_chunk(0),
+        ota_chunk_retries(0)
+  #endif
 {
   maison = this;
+  memset(tasks, 0, sizeof(tasks));
+  #if MAISON_SAMPLING
+    sampler = NULL;
+  #endif
+  #if MAISON_INPUTS > 0
+    input_count      = 0;
+    input_event_head = input_event_tail = 0;
+  #endif
+  #if MAISON_EVENT_CHANNELS > 0
+    memset(channel_process, 0, sizeof(channel_process));
+  #endif
 }
 
 Maison::Maison(uint8_t _feature_mask, void * _user_mem, uint16_t _user_mem_length) :
@@ -48,6 +171,7 @@ Maison::Maison(uint8_t _feature_mask, void * _user_mem, uint16_t _user_mem_lengt
     last_reconnect_attempt(0),
        connect_retry_count(0),
        first_connect_trial(true),
+              stayed_awake(false),
              user_callback(NULL),
             user_sub_topic(NULL),
                   user_qos(0),
@@ -58,9 +182,27 @@ Maison::Maison(uint8_t _feature_mask, void * _user_mem, uint16_t _user_mem_lengt
   counting_lost_connection(true),
    wait_for_ota_completion(false),
                 reboot_now(false),
+          reconnect_needed(CONFIG_UNCHANGED),
                restart_now(false)
+  #if MQTT_OTA
+        , ota_chunk_count(0),
+           ota_chunk_size(0),
+           ota_next_chunk(0),
+        ota_chunk_retries(0)
+  #endif
 {
   maison = this;
+  memset(tasks, 0, sizeof(tasks));
+  #if MAISON_SAMPLING
+    sampler = NULL;
+  #endif
+  #if MAISON_INPUTS > 0
+    input_count      = 0;
+    input_event_head = input_event_tail = 0;
+  #endif
+  #if MAISON_EVENT_CHANNELS > 0
+    memset(channel_process, 0, sizeof(channel_process));
+  #endif
 }
 
 bool Maison::setup()
@@ -69,6 +211,9 @@ bool Maison::setup()
 
   DO {
     if (!   load_mems()) ERROR("Unable to load states");
+
+    continue_deep_sleep();  // Doesn't return if a chained Deep Sleep is not completed
+
     if (! load_config()) ERROR("Unable to load config");
     if (is_hard_reset()) init_mem();
 
@@ -119,24 +264,181 @@ char * Maison::build_topic(const char * _topic_suffix, char * _buffer, uint16_t
   return _buffer;
 }
 
+#if MAISON_REDACT_CONFIG
+
+  // The Redactor replaces the string values of the password members of a 
+  // JSON text with "****" as it is streamed, without parsing the whole
+  // document. A string followed by ':' is a member name.
+
+  class Redactor
+  {
+    private:
+      enum RState { R_OUTSIDE, R_STRING, R_STRING_ESC, R_REDACTED, R_REDACTED_ESC } state;
+
+      char    name[16];
+      uint8_t name_len;
+      bool    name_match;   // The last string is a password member name
+      bool    redact_value; // The next string value is to be redacted
+
+      bool is_password() {
+        return (name_len < sizeof(name)) &&
+               ((strcmp(name, "wifi_password") == 0) || (strcmp(name, "mqtt_password") == 0));
+      }
+
+    public:
+      Redactor() : state(R_OUTSIDE), name_len(0), name_match(false), redact_value(false) { }
+
+      // Put in _out the characters to be sent for _c. Returns their count (0 to 5).
+
+      uint8_t filter(char _c, char * _out) {
+        switch (state) {
+          case R_OUTSIDE:
+            if (_c == '"') {
+              if (redact_value) {
+                redact_value = false;
+                state        = R_REDACTED;
+                memcpy(_out, "\"****", 5);
+                return 5;
+              }
+              state    = R_STRING;
+              name_len = 0;
+            }
+            else if (_c == ':') {
+              redact_value = name_match;
+              name_match   = false;
+            }
+            else if ((_c != ' ') && (_c != '\t') && (_c != '\r') && (_c != '\n')) {
+              name_match = redact_value = false;
+            }
+            break;
+
+          case R_STRING:
+            if (_c == '\\') {
+              state = R_STRING_ESC;
+            }
+            else if (_c == '"') {
+              if (name_len < sizeof(name)) name[name_len] = 0;
+              name_match = is_password();
+              state      = R_OUTSIDE;
+              break;
+            }
+            if (name_len < sizeof(name)) name[name_len++] = _c;
+            break;
+
+          case R_STRING_ESC:
+            if (name_len < sizeof(name)) name[name_len++] = _c;
+            state = R_STRING;
+            break;
+
+          case R_REDACTED:
+            if (_c == '\\') state = R_REDACTED_ESC;
+            else if (_c == '"') {
+              state = R_OUTSIDE;
+              break;
+            }
+            return 0;
+
+          case R_REDACTED_ESC:
+            state = R_REDACTED;
+            return 0;
+        }
+
+        _out[0] = _c;
+        return 1;
+      }
+  };
+
+#endif
+
+// Copy _length bytes of the config content from _file to _out (if not NULL)
+// through a small fixed size buffer. Returns the number of bytes sent,
+// that is less than _length if passwords are redacted or if the file is
+// shorter than expected.
+
+static uint32_t copy_config(File & _file, uint16_t _length, Print * _out)
+{
+  uint8_t  chunk[64];
+  uint32_t count = 0;
+
+  #if MAISON_REDACT_CONFIG
+    Redactor redactor;
+    char     out[64 + 5];
+    uint8_t  out_len = 0;
+  #endif
+
+  while (_length > 0) {
+    uint16_t n = (_length < sizeof(chunk)) ? _length : sizeof(chunk);
+
+    if (_file.read(chunk, n) != n) break;
+    _length -= n;
+
+    #if MAISON_REDACT_CONFIG
+      for (uint16_t i = 0; i < n; i++) {
+        out_len += redactor.filter(chunk[i], &out[out_len]);
+        if (out_len >= 64) {
+          if (_out != NULL) _out->write((uint8_t *) out, out_len);
+          count  += out_len;
+          out_len = 0;
+        }
+      }
+    #else
+      if (_out != NULL) _out->write(chunk, n);
+      count += n;
+    #endif
+  }
+
+  #if MAISON_REDACT_CONFIG
+    if (out_len > 0) {
+      if (_out != NULL) _out->write((uint8_t *) out, out_len);
+      count += out_len;
+    }
+  #endif
+
+  return count;
+}
+
+// The config content is streamed to the broker, without being loaded in 
+// memory. With MAISON_REDACT_CONFIG, a first pass is done to get the 
+// length of the redacted content, as it must be known to begin the publish.
+// If the file can't be read up to this length, the connection is dropped
+// for the broker to discard the incomplete message.
+
 void Maison::send_config_msg()
 {
-  File file = SPIFFS.open("/config.json", "r");
-  if (!file) {
+  File file;
+  config_record_header header;
+
+  if (!SPIFFS.begin() || !open_config(file, 0, header)) {
     DEBUGLN(" ERROR: Unable to open current config file");
   }
   else {
-    char buff[50];
-    mqtt_client.beginPublish(build_topic(MAISON_CONFIG_TOPIC, buff, sizeof(buff)),
-                             file.size() + strlen(config.device_name) + 44,
-                             false);
-    mqtt_client.write((uint8_t *) "{\"device\":\"", 11);
-    mqtt_client.write((uint8_t *) config.device_name, strlen(config.device_name));
-    mqtt_client.write((uint8_t *) "\",\"msg_type\":\"CONFIG\",\"content\":", 32);
-    file.read((uint8_t *) buffer, file.size());
-    mqtt_client.write((uint8_t *) buffer, file.size());
-    mqtt_client.write((uint8_t *) "}", 1);
-    mqtt_client.endPublish();
+    uint32_t length = header.length;
+
+    #if MAISON_REDACT_CONFIG
+      uint32_t pos = file.position();
+      length = copy_config(file, header.length, NULL);
+      file.seek(pos);
+    #endif
+
+    if (!mqtt_client.beginPublish(build_topic(MAISON_CONFIG_TOPIC, scratch_topic, SCRATCH_TOPIC_SIZE),
+                                  length + strlen(config.device_name) + 44,
+                                  false)) {
+      DEBUGLN(" ERROR: Unable to publish the config");
+    }
+    else {
+      mqtt_client.write((uint8_t *) "{\"device\":\"", 11);
+      mqtt_client.write((uint8_t *) config.device_name, strlen(config.device_name));
+      mqtt_client.write((uint8_t *) "\",\"msg_type\":\"CONFIG\",\"content\":", 32);
+
+      if (copy_config(file, header.length, &mqtt_client) != length) {
+        DEBUGLN(" ERROR: Config file read failed. Connection dropped");
+        wifi_client->stop();
+      }
+      else {
+        mqtt_client.write((uint8_t *) "}", 1);
+        mqtt_client.endPublish();
+      }
+    }
 
     file.close();
   }
@@ -144,10 +446,25 @@ void Maison::send_config_msg()
 
 void Maison::send_state_msg(const char * _msg_type)
 {
-  static char vbat[15];
-  static char   ip[20];
-  static char  mac[20];
+  char vbat[15];
+  char   ip[20];
+  char  mac[20];
   byte ma[6];
+  uint32_t     free_heap;
+  heap_block_t max_block;
+  uint8_t      frag;
+
+  ESP.getHeapStats(&free_heap, &max_block, &frag);
+  if (free_heap < heap_low_water) heap_low_water = free_heap;
+
+  // Time elapsed since the last HOURS_24 watchdog deadline, 24 hours before
+  // the next one, or since the reset if this deadline is before it (the
+  // first period is shortened to the phase offset of the device).
+
+  uint32_t elapsed        = (24000U * ONE_HOUR) - (mem.timers[WATCHDOG_TIMER] - now());
+  if (elapsed > now()) elapsed = now();
+  uint16_t hours          = elapsed / (1000U * ONE_HOUR);
+  uint32_t millis_in_hour = elapsed % (1000U * ONE_HOUR);
 
   ip2str(WiFi.localIP(), ip, sizeof(ip));
   WiFi.macAddress(ma);
@@ -175,6 +492,10 @@ void Maison::send_state_msg(const char * _msg_type)
       ",\"lost\":%u"
       ",\"rssi\":%ld"
       ",\"heap\":%u"
+      ",\"max_block\":%u"
+      ",\"frag\":%u"
+      ",\"heap_low\":%u"
+      ",\"allocs\":%u"
       ",\"app_name\":\"" APP_NAME "\""
       ",\"app_version\":\"" APP_VERSION "\""
       "%s"
@@ -186,18 +507,50 @@ void Maison::send_state_msg(const char * _msg_type)
     reset_reason(),
     mem.state,
     mem.return_state,
-    mem.hours_24_count,
-    mem.one_hour_step_count,
+    hours,
+    millis_in_hour,
     mem.lost_count,
     wifi_connected() ? WiFi.RSSI() : 0,
-    ESP.getFreeHeap(),
+    free_heap,
+    max_block,
+    frag,
+    heap_low_water,
+    heap_alloc_count,
     vbat);
 }
 
-void Maison::get_new_config()
+void Maison::send_heap_msg()
+{
+  uint32_t     free_heap;
+  heap_block_t max_block;
+  uint8_t      frag;
+
+  ESP.getHeapStats(&free_heap, &max_block, &frag);
+  if (free_heap < heap_low_water) heap_low_water = free_heap;
+
+  send_msg(
+    MAISON_STATE_TOPIC,
+    F("{"
+       "\"device\":\"%s\""
+      ",\"msg_type\":\"HEAP\""
+      ",\"heap\":%u"
+      ",\"max_block\":%u"
+      ",\"frag\":%u"
+      ",\"heap_low\":%u"
+      ",\"allocs\":%u"
+    "}"),
+    config.device_name,
+    free_heap,
+    max_block,
+    frag,
+    heap_low_water,
+    heap_alloc_count);
+}
+
+void Maison::get_new_config(char * _json, size_t _length)
 {
-  DynamicJsonDocument doc(2048);
-  DeserializationError error = deserializeJson(doc, &buffer[7]);
+  JsonDocument & doc = get_json_doc();
+  DeserializationError error = deserializeJson(doc, _json, _length);
 
   if (error) {
     JSON_DEBUGLN(F(" ERROR: Unable to parse JSON content"));
@@ -205,20 +558,15 @@ void Maison::get_new_config()
   else {
     Config cfg;
 
+    memset(&cfg, 0, sizeof(cfg));
+
     if (!retrieve_config(doc.as<JsonObject>(), cfg))
     {
       JSON_DEBUGLN(F(" ERROR: Unable to retrieve config from received message"));
     }
     else {
       if (cfg.version > config.version) {
-        mqtt_client.unsubscribe(topic);
-        if (user_sub_topic) mqtt_client.unsubscribe(user_topic);
-        config = cfg;
-        #if JSON_TESTING
-          show_config(config);
-        #endif
-        save_config();
-        init_callbacks();
+        apply_config(cfg);
       }
       else {
         JSON_DEBUGLN(F(" ERROR: New config with a wrong version number. Not saved."));
@@ -229,51 +577,475 @@ void Maison::get_new_config()
   }
 }
 
+// A config patch is a JSON merge patch (RFC 7396) of the config file content
+// with two required members: base_version, that must be the current config
+// version, and version, the new config version. For example:
+//
+//   CONFIG_PATCH:{"base_version":12,"version":13,"mqtt_port":8884}
+
+void Maison::get_config_patch(char * _json, size_t _length)
+{
+  JsonDocument & doc = get_json_doc();
+  DeserializationError error = deserializeJson(doc, _json, _length);
+
+  if (error) {
+    JSON_DEBUGLN(F(" ERROR: Unable to parse JSON content"));
+    log(F("Error: Config patch content in a wrong format."));
+    return;
+  }
+
+  JsonObject patch = doc.as<JsonObject>();
+
+  if ((patch["base_version"].as<int>() != config.version) ||
+      (patch["version"].as<int>() <= config.version)) {
+    JSON_DEBUGLN(F(" ERROR: Config patch with a wrong version number. Not applied."));
+    log(F("Error: Received Config Patch with wrong version number."));
+  }
+  else {
+    Config cfg = config;
+
+    if (!patch_config(patch, cfg)) {
+      JSON_DEBUGLN(F(" ERROR: Unable to apply config patch"));
+      log(F("Error: Config patch content in a wrong format."));
+    }
+    else {
+      apply_config(cfg);
+    }
+  }
+  send_config_msg();
+}
+
+#define CHANGED(field) (memcmp(&_config.field, &config.field, sizeof(config.field)) != 0)
+#define CHANGED_STR(field) (strncmp(_config.field, config.field, sizeof(config.field)) != 0)
+
+Maison::ConfigImpact Maison::config_impact(Config & _config)
+{
+  if (CHANGED_STR(wifi_ssid) || CHANGED_STR(wifi_password) || CHANGED(ip) || 
+      CHANGED(subnet_mask)   || CHANGED(gateway)           || CHANGED(dns)) {
+    return CONFIG_WIFI;
+  }
+
+  if (CHANGED_STR(mqtt_server)   || CHANGED(mqtt_port)         || 
+      CHANGED_STR(mqtt_username) || CHANGED_STR(mqtt_password) || CHANGED(mqtt_fingerprint) ||
+      CHANGED(mqtt_tls_buffer)) {
+    return CONFIG_MQTT;
+  }
+
+  // The framework topics are built from the MAC address: a device_name 
+  // change doesn't require new subscriptions. But the MQTT client name
+  // ("client-" + device_name) changes. With Deep Sleep, the persistent
+  // session held by the broker is tied to this name: the device reconnects
+  // for the new session to take over now. Otherwise, the client name will
+  // be updated at the next connection.
+
+  if (CHANGED_STR(device_name) && use_deep_sleep()) return CONFIG_MQTT;
+
+  if (CHANGED_STR(device_name) || CHANGED(report_offset)) return CONFIG_IN_PLACE;
+
+  return CONFIG_UNCHANGED;
+}
+
+// Save the new config and take the cheapest action that applies it. 
+// Reconnections are done by loop(), outside of the MQTT callback.
+
+void Maison::apply_config(Config & _config)
+{
+  ConfigImpact impact = config_impact(_config);
+  bool         rephase = CHANGED(report_offset);
+
+  config = _config;
+  if (rephase) arm_timer(WATCHDOG_TIMER, watchdog_deadline());
+  if (network_is_available()) update_device_name();
+  #if JSON_TESTING
+    show_config(config);
+  #endif
+
+  const char * action = "";
+
+  switch (impact) {
+    case CONFIG_UNCHANGED: action = "No parameter changed.";             break;
+    case CONFIG_IN_PLACE:  action = "Applied.";                          break;
+    case CONFIG_MQTT:      action = "Reconnecting to the MQTT broker.";  break;
+    case CONFIG_WIFI:      action = "Reconnecting to the WiFi network."; break;
+  }
+
+  if (save_config()) {
+    log(F("Info: Config version %u saved (%u bytes written). %s"), 
+        config.version, 
+        config_bytes_written, 
+        action);
+  }
+  else {
+    log(F("Error: Unable to save config version %u. %s"), config.version, action);
+  }
+
+  if (impact > reconnect_needed) reconnect_needed = impact;
+}
+
+// Reconnect to the network and/or the MQTT broker after a config change.
+// If the connection cannot be done with the new config, the usual lost 
+// connection processing of loop() is used.
+
+void Maison::reconnect()
+{
+  NET_SHOW("reconnect()");
+
+  wifi_flush();
+
+  if (reconnect_needed == CONFIG_WIFI) {
+    WiFi.disconnect();
+    if (config.ip == 0) WiFi.config(0U, 0U, 0U); // Back to DHCP
+  }
+
+  reconnect_needed = CONFIG_UNCHANGED;
+  mem.tls_buffer_size = 0; // The broker may have changed: probe it again
+
+  bool result = mqtt_connect();
+
+  if (result) log(F("Info: Config version %u applied."), config.version);
+
+  NET_SHOW_RESULT("reconnect()");
+}
+
 #if MQTT_OTA
 
   #include <StreamString.h>
+
+  // The OTAConsumer receives the new firmware from the MQTT stream and stages
+  // it in a sector sized block before handing it to the Updater. Flash is then
+  // written (and the MD5 digest updated) a whole sector at a time instead of
+  // one byte per call.
+  //
+  // The received code may be compressed with heatshrink
+  // (https://github.com/atomicobject/heatshrink). It is then decompressed on
+  // the fly using a window of 2^window_bits bytes. The SIZE and MD5 of the
+  // NEW_CODE request are related to the decompressed code.
+  //
+  // The received code may also be a delta against the currently running
+  // code, as produced by bsdiff (https://github.com/mendsley/bsdiff) once its
+  // bzip2 compression removed: the ENDSLEY/BSDIFF43 header followed by
+  // control, diff and extra blocks. The running code is read back from flash
+  // while the patch is applied, the result being sent to the Updater.
+
   class OTAConsumer : public Stream
   {
   private:
-    size_t length;
-    int count;
-    bool running;
-    bool completed;
-    StreamString error; 
+    enum HSState    : uint8_t { HS_TAG, HS_LITERAL, HS_INDEX, HS_COUNT };
+    enum PatchState : uint8_t { P_HEADER, P_CTRL, P_DIFF, P_EXTRA };
+
+    size_t       length;      // Decompressed bytes still expected
+    size_t       received;    // Bytes received from the stream
+    uint8_t    * block;       // Staging buffer, allocated for the upload duration only
+    size_t       block_len;
+    uint32_t     start_time;
+    uint32_t     duration;
+    bool         running;
+    bool         completed;
+    StreamString error;
+
+    // Heatshrink decoder state. No window means no compression.
+
+    uint8_t    * window;
+    uint16_t     window_mask;
+    uint16_t     head;
+    uint8_t      window_bits;
+    uint8_t      lookahead_bits;
+    HSState      hs_state;
+    uint8_t      hs_needed;   // Bits still required to complete the current field
+    uint16_t     hs_value;    // Bits accumulated for the current field
+    uint16_t     hs_index;
+
+    // Delta patch state
+
+    bool         delta;
+    const __FlashStringHelper * patch_error; // NULL if the patch is applied without error
+    PatchState   p_state;
+    uint8_t      p_ctrl[24];  // Header or control triple being received
+    uint8_t      p_count;
+    int32_t      p_diff;      // Diff bytes remaining in the current control
+    int32_t      p_extra;     // Extra bytes remaining in the current control
+    int32_t      p_seek;
+    int32_t      old_pos;
+    int32_t      old_size;
+    size_t       total;       // New code size, as announced in the patch header
+    uint32_t     old_cache[16];
+    int32_t      old_cache_addr;
+
+    bool flush_block() {
+      if (block_len > 0) {
+        if (Update.write(block, block_len) != block_len) {
+          showError(F("cons.flush_block()"));
+          running = false;
+          return false;
+        }
+        block_len = 0;
+        yield();
+      }
+      return true;
+    }
+
+    inline void put(uint8_t b) {
+      block[block_len++] = b;
+      length--;
+
+      if ((block_len == OTA_BLOCK_SIZE) || (length == 0)) flush_block();
+    }
+
+    // bsdiff integers are 64 bits sign-magnitude, little endian. Code sizes
+    // only require the lower 32 bits.
+
+    static int32_t offtin(const uint8_t * _buf) {
+      int32_t y = (_buf[3] & 0x7F);
+      for (int i = 2; i >= 0; i--) y = (y << 8) | _buf[i];
+      if ((_buf[4] | _buf[5] | _buf[6] | (_buf[7] & 0x7F)) != 0) return INT32_MIN;
+      return (_buf[7] & 0x80) ? -y : y;
+    }
+
+    uint8_t old_byte(int32_t _pos) {
+      if ((_pos < 0) || (_pos >= old_size)) return 0;
+
+      int32_t addr = _pos & ~(sizeof(old_cache) - 1);
+      if (addr != old_cache_addr) {
+        ESP.flashRead(addr, old_cache, sizeof(old_cache));
+        old_cache_addr = addr;
+      }
+      return ((uint8_t *) old_cache)[_pos - addr];
+    }
+
+    void patch_failed(const __FlashStringHelper * _msg) {
+      OTA_DEBUG(F("cons.patch() : "));
+      OTA_DEBUGLN(_msg);
+      patch_error = _msg;
+      running     = false;
+    }
+
+    void next_control() {
+      if      (p_diff  > 0) p_state = P_DIFF;
+      else if (p_extra > 0) p_state = P_EXTRA;
+      else {
+        old_pos += p_seek;
+        p_state  = P_CTRL;
+      }
+    }
+
+    void patch(uint8_t b) {
+      switch (p_state) {
+        case P_HEADER:
+          p_ctrl[p_count++] = b;
+          if (p_count == sizeof(p_ctrl)) {
+            if (memcmp(p_ctrl, "ENDSLEY/BSDIFF43", 16) != 0) {
+              patch_failed(F("Bad header"));
+            }
+            else if (offtin(&p_ctrl[16]) != (int32_t) total) {
+              patch_failed(F("New size differ from SIZE"));
+            }
+            p_count = 0;
+            p_state = P_CTRL;
+          }
+          break;
+
+        case P_CTRL:
+          p_ctrl[p_count++] = b;
+          if (p_count == sizeof(p_ctrl)) {
+            p_diff  = offtin(&p_ctrl[0]);
+            p_extra = offtin(&p_ctrl[8]);
+            p_seek  = offtin(&p_ctrl[16]);
+            p_count = 0;
+            if ((p_diff < 0) || (p_extra < 0) || (p_seek == INT32_MIN)) {
+              patch_failed(F("Bad control block"));
+            }
+            else {
+              next_control();
+            }
+          }
+          break;
+
+        case P_DIFF:
+          put(b + old_byte(old_pos++));
+          if (--p_diff == 0) next_control();
+          break;
+
+        case P_EXTRA:
+          put(b);
+          if (--p_extra == 0) next_control();
+          break;
+      }
+    }
+
+    // Receives the decompressed stream
+
+    inline void output(uint8_t b) {
+      if (window != NULL) window[head++ & window_mask] = b;
+
+      if (delta) patch(b);
+      else put(b);
+    }
+
+    void decode(uint8_t b) {
+      for (uint8_t mask = 0x80; (mask != 0) && running && (length > 0); mask >>= 1) {
+        hs_value = (hs_value << 1) | ((b & mask) ? 1 : 0);
+        if (--hs_needed > 0) continue;
+
+        switch (hs_state) {
+          case HS_TAG:
+            hs_state  = hs_value ? HS_LITERAL : HS_INDEX;
+            hs_needed = hs_value ? 8 : window_bits;
+            break;
+
+          case HS_LITERAL:
+            output(hs_value);
+            hs_state  = HS_TAG;
+            hs_needed = 1;
+            break;
+
+          case HS_INDEX:
+            hs_index  = hs_value;
+            hs_state  = HS_COUNT;
+            hs_needed = lookahead_bits;
+            break;
+
+          case HS_COUNT:
+            for (uint16_t count = hs_value + 1; (count > 0) && running && (length > 0); count--) {
+              output(window[(head - hs_index - 1) & window_mask]);
+            }
+            hs_state  = HS_TAG;
+            hs_needed = 1;
+            break;
+        }
+        hs_value = 0;
+      }
+    }
+
+    void release() {
+      if (block != NULL) {
+        free(block);
+        block = NULL;
+      }
+      if (window != NULL) {
+        free(window);
+        window = NULL;
+      }
+    }
 
   public:
-    bool begin(size_t _size, const char * _md5 = NULL) {
-      length    = _size;
-      completed = false;
-      count = 0;
-      running   = Update.begin(_size);
-      if (!running) showError(F("cons.begin()"));
-      else if (_md5) Update.setMD5(_md5);
+
+    /// Prepare the reception of a new code.
+    ///
+    /// @param[in] _size The decompressed code size
+    /// @param[in] _md5 The MD5 digest of the decompressed code
+    /// @param[in] _window_bits Heatshrink window size (log2). 0 if not compressed.
+    /// @param[in] _lookahead_bits Heatshrink lookahead size (log2).
+    /// @param[in] _delta True if the stream is a patch against the running code.
+
+    bool begin(size_t    _size, 
+               const char * _md5            = NULL,
+               uint8_t      _window_bits    = 0,
+               uint8_t      _lookahead_bits = 0,
+               bool         _delta          = false) {
+      length         = total = _size;
+      received       = 0;
+      block_len      = 0;
+      duration       = 0;
+      completed      = false;
+      running        = false;
+      window_bits    = _window_bits;
+      lookahead_bits = _lookahead_bits;
+      window_mask    = (1 << _window_bits) - 1;
+      head           = 0;
+      hs_state       = HS_TAG;
+      hs_needed      = 1;
+      hs_value       = 0;
+      delta          = _delta;
+      patch_error    = NULL;
+      p_state        = P_HEADER;
+      p_count        = 0;
+      old_pos        = 0;
+      old_size       = ESP.getSketchSize();
+      old_cache_addr = -1;
+
+      release();
+
+      block = (uint8_t *) malloc(OTA_BLOCK_SIZE);
+      if (_window_bits > 0) window = (uint8_t *) calloc(1, 1 << _window_bits);
+      count_heap_alloc();
+
+      if ((block == NULL) || ((_window_bits > 0) && (window == NULL))) {
+        OTA_DEBUGLN(F("cons.begin() : Unable to allocate buffers"));
+        release();
+      }
+      else {
+        running = Update.begin(_size);
+        if (!running) {
+          showError(F("cons.begin()"));
+          release();
+        }
+        else {
+          if (_md5) Update.setMD5(_md5);
+          start_time = millis();
+        }
+      }
       return running;
     }
 
     size_t write(uint8_t b) {
-      if (running) {
-        if (--length < 0) running = false;
-        else {
-          return Update.write(&b, 1);
+      if (!running || (length == 0)) return 0;
+
+      received++;
+
+      if (window != NULL) decode(b);
+      else output(b);
+
+      return 1;
+    }
+
+    size_t write(const uint8_t * _data, size_t _size) {
+      size_t count = 0;
+
+      if ((window != NULL) || delta) {
+        while (running && (length > 0) && (count < _size)) {
+          if (window != NULL) decode(_data[count++]);
+          else output(_data[count++]);
         }
+        received += count;
+        return count;
       }
-      if (++count > 10000) {
-        count = 0;
-        yield();
+
+      if (_size > length) _size = length; // Ignore what is beyond the announced size
+
+      while (running && (count < _size)) {
+        size_t chunk = min(OTA_BLOCK_SIZE - block_len, _size - count);
+
+        memcpy(&block[block_len], &_data[count], chunk);
+        block_len += chunk;
+        count     += chunk;
+        length    -= chunk;
+
+        if ((block_len == OTA_BLOCK_SIZE) || (length == 0)) flush_block();
       }
-      return 0;
+      received += count;
+      return count;
     }
 
     bool end() {
-      running = false;
+      if (running) flush_block();
+      running   = false;
       completed = Update.end();
+      duration  = millis() - start_time;
       if (!completed) showError(F("cons.end()"));
+      release();
       return completed;
     }
 
-    OTAConsumer()      { running = false;          }
+    // Resets the Updater too: with bytes remaining, Update.end(false)
+    // drops the partial image, and a new Update.begin() can be done.
+
+    void abort() {
+      if (running && Update.isRunning()) Update.end(false);
+      running = false;
+      release();
+    }
+
+    OTAConsumer() { running = false; patch_error = NULL; block = NULL; window = NULL; }
 
     int    available() { return 0;                 } // not used
     int         read() { return 0;                 } // not used
@@ -282,10 +1054,23 @@ void Maison::get_new_config()
     bool isCompleted() { return completed;         }
     bool   isRunning() { return running;           }
     int     getError() { return Update.getError(); }
-    
+
+    uint32_t getDuration() { return duration;      } // In milliseconds
+    size_t   getReceived() { return received;      } // In bytes, as transmitted
+
+    // Upload throughput in KB/s of transmitted bytes, measured from begin() to end()
+
+    float getThroughput() {
+      return (duration == 0) ? 0.0 : ((received / 1024.0) / (duration / 1000.0));
+    }
+
     StreamString & getErrorStr() {
       error.flush(); 
-      Update.printError(error);
+      if (patch_error != NULL) {
+        error.print(F("Delta patch error: "));
+        error.print(patch_error);
+      }
+      else Update.printError(error);
       error.trim();
       return error; 
     }
@@ -297,57 +1082,313 @@ void Maison::get_new_config()
     }
   } cons;
 
-#endif
+  void Maison::complete_ota()
+  {
+    yield();
+    
+    if (cons.end()) {
+      OTA_DEBUG(F(" Upload Completed: "));
+      OTA_DEBUG(cons.getReceived());
+      OTA_DEBUG(F(" bytes received in "));
+      OTA_DEBUG(cons.getDuration());
+      OTA_DEBUG(F(" ms ("));
+      OTA_DEBUG(cons.getThroughput());
+      OTA_DEBUGLN(F(" KB/s). Rebooting..."));
+      log(F("Code upload completed: %u bytes received in %u ms (%.1f KB/s). Rebooting"),
+          cons.getReceived(),
+          cons.getDuration(),
+          cons.getThroughput());
+      reboot_now = true;
+    }
+    else {
+      OTA_DEBUG(F("Error: Code upload not completed: "));
+      OTA_DEBUGLN(cons.getErrorStr().c_str());
+      log(F("Error: Code upload not completed: %s"), 
+          cons.getErrorStr().c_str());
+    }
+    wait_for_ota_completion = false;
+  }
 
-void Maison::process_callback(const char * _topic, byte * _payload, unsigned int _length)
+  // Subscribe to (or unsubscribe from) the retained topic of a chunk of a
+  // shared image. 
+
+  bool Maison::subscribe_ota_chunk(bool _subscribe, uint16_t _index)
+  {
+    if (_index >= ota_chunk_count) return true;
+
+    char chunk_topic[sizeof(ota_topic)];
+
+    snprintf(chunk_topic, sizeof(chunk_topic), "%s%u", ota_topic, _index);
+
+    OTA_DEBUG(_subscribe ? F(" Subscribing to ") : F(" Unsubscribing from "));
+    OTA_DEBUGLN(chunk_topic);
+
+    return _subscribe ? mqtt_client.subscribe(chunk_topic, 1) : 
+                        mqtt_client.unsubscribe(chunk_topic);
+  }
+
+  // The device is subscribed to the next expected chunk and to the one after
+  // it: the broker sends the following chunk while the current one is
+  // written to flash, instead of waiting for a new subscription. As the
+  // retained chunks are sent in the subscriptions order, they are received
+  // in sequence.
+
+  bool Maison::subscribe_ota_window(bool _subscribe)
+  {
+    bool result = subscribe_ota_chunk(_subscribe, ota_next_chunk);
+    return subscribe_ota_chunk(_subscribe, ota_next_chunk + 1) && result;
+  }
+
+  // A shared image chunk is composed of the CRC-32 of the data (4 bytes, little 
+  // endian, as computed by CRC32()) followed by the data. All chunks are 
+  // CHUNK_SIZE bytes long, except the last one. 
+  //
+  // The payload is located in the mqtt_client buffer: it must be consumed 
+  // before anything is sent to the broker.
+
+  void Maison::process_ota_chunk(const char * _topic, byte * _payload, unsigned int _length)
+  {
+    long index = atol(&_topic[strlen(ota_topic)]);
+
+    if (index != ota_next_chunk) {
+      OTA_DEBUG(F(" Unexpected chunk ignored: "));
+      OTA_DEBUGLN(index);
+      return;
+    }
+
+    unsigned int size  = (_length > 4) ? (_length - 4) : 0;
+    bool         valid = (size > 0) && 
+                         ((index == (ota_chunk_count - 1)) ? (size <= ota_chunk_size) :
+                                                             (size == ota_chunk_size));
+    if (valid) {
+      uint32_t crc = _payload[0] | (_payload[1] << 8) | (_payload[2] << 16) | ((uint32_t) _payload[3] << 24);
+      valid = (crc == CRC32(&_payload[4], size));
+    }
+
+    if (!valid) {
+      OTA_DEBUG(F(" Chunk with bad size or CRC: "));
+      OTA_DEBUGLN(index);
+
+      if (++ota_chunk_retries <= OTA_CHUNK_RETRIES) {
+        // The retained chunks are sent again by the broker on new subscriptions
+        subscribe_ota_window(false);
+        subscribe_ota_window(true);
+        return;
+      }
+      cons.abort();
+      subscribe_ota_window(false);
+      wait_for_ota_completion = false;
+      OTA_DEBUGLN(F("Error: Code upload aborted. Shared image chunk corrupted"));
+      log(F("Error: Code upload aborted. Shared image chunk %u corrupted"), ota_next_chunk);
+      return;
+    }
+
+    cons.write(&_payload[4], size);
+
+    if (!cons.isRunning()) {
+      subscribe_ota_window(false);
+      wait_for_ota_completion = false;
+      OTA_DEBUG(F("Error: Code upload not completed: "));
+      OTA_DEBUGLN(cons.getErrorStr().c_str());
+      log(F("Error: Code upload not completed: %s"), 
+          cons.getErrorStr().c_str());
+      return;
+    }
+
+    ota_chunk_retries = 0;
+
+    subscribe_ota_chunk(false, ota_next_chunk);
+
+    if (++ota_next_chunk == ota_chunk_count) {
+      complete_ota();
+    }
+    else if (!subscribe_ota_chunk(true, ota_next_chunk + 1)) {
+      subscribe_ota_window(false);
+      cons.abort();
+      wait_for_ota_completion = false;
+      OTA_DEBUGLN(F("Error: Code upload aborted. Unable to subscribe to shared image"));
+      log(F("Error: Code upload aborted. Unable to subscribe to shared image"));
+    }
+  }
+
+#endif
+
+// Check if a ctrl message payload (not null terminated) begins with _command
+
+static bool is_command(const char * _payload, unsigned int _length, const char * _command)
+{
+  size_t length = strlen(_command);
+  return (_length >= length) && (memcmp(_payload, _command, length) == 0);
+}
+
+void Maison::process_callback(const char * _topic, byte * _payload, unsigned int _length)
 {
   NET_SHOW("process_callback()");
 
   some_message_received = true;
 
-  if (strcmp(_topic, build_topic(MAISON_CTRL_TOPIC, buffer, sizeof(buffer))) == 0) {
-    int len;
+  // While the OTA stream of a (non shared) code upload is set, PubSubClient
+  // reports the length of the whole message, while only its beginning is in
+  // the client buffer. It follows the packet type, 1 to 4 remaining length
+  // bytes, the topic name with its 2 bytes length, and the 2 bytes message
+  // id of the QoS 1 ctrl topic. The user callback gets the original length.
 
-    memcpy(buffer, _payload, len = (_length >= sizeof(buffer)) ? (sizeof(buffer) - 1) : _length);
-    buffer[len] = 0;
+  unsigned int length = _length;
 
-    if (!cons.isRunning()) {
-      NET_DEBUG(F(" Received MQTT Message: "));
-      NET_DEBUGLN(buffer);
+  #if MQTT_OTA
+    if (wait_for_ota_completion && (ota_chunk_count == 0)) {
+      unsigned int remaining = 2 + strlen(_topic) + 2 + _length;
+      unsigned int overhead  = 1 + ((remaining < 128)     ? 1 :
+                                    (remaining < 16384)   ? 2 :
+                                    (remaining < 2097152) ? 3 : 4) + remaining - _length;
+
+      if (length + overhead > MQTT_MAX_PACKET_SIZE) {
+        length = (overhead < MQTT_MAX_PACKET_SIZE) ? MQTT_MAX_PACKET_SIZE - overhead : 0;
+      }
+    }
+  #endif
+
+  #if MQTT_OTA
+    if (wait_for_ota_completion && (ota_chunk_count > 0) &&
+        (strncmp(_topic, ota_topic, strlen(ota_topic)) == 0)) {
+      process_ota_chunk(_topic, _payload, length);
+      return;
     }
+  #endif
+
+  // The ctrl messages are parsed in place, in the MQTT client buffer. 
+  // Strings retrieved from JSON content are located in this buffer and 
+  // will be overwritten by anything sent to the broker (e.g. with log()).
+
+  if (strcmp(_topic, topic) == 0) {
+    char * payload = (char *) _payload;
+
+    #if NET_TESTING
+      if (!wait_for_ota_completion) {
+        NET_DEBUG(F(" Received MQTT Message: "));
+        Serial.write(_payload, (length < 200) ? length : 200);
+        NET_DEBUGLN();
+      }
+    #endif
 
     #if MQTT_OTA
-      if (strncmp(buffer, "NEW_CODE:{", 10) == 0) {
-        DynamicJsonDocument doc(2048);
-        DeserializationError error = deserializeJson(doc, &buffer[9]);
+      if (is_command(payload, length, "NEW_CODE:{")) {
+        JsonDocument & doc = get_json_doc();
+        DeserializationError error = deserializeJson(doc, &payload[9], length - 9);
 
         if (error) {
           OTA_DEBUGLN(F("Error: JSON content is in a wrong format"));
           log(F("Error: JSON content is in a wrong format"));
         }
         else {
-          long         size = doc["SIZE"].as<long>();
-          const char * name = doc["APP_NAME"].as<const char *>();
-          const char * md5  = doc["MD5"].as<const char *>();
+          long         size        = doc["SIZE"].as<long>();
+          const char * name        = doc["APP_NAME"].as<const char *>();
+          const char * md5         = doc["MD5"].as<const char *>();
+          const char * compression = doc["COMPRESSION"].as<const char *>();
+          int          window      = doc["WINDOW"].as<int>();
+          int          lookahead   = doc["LOOKAHEAD"].as<int>();
+          const char * delta       = doc["DELTA"].as<const char *>();
+          const char * base_md5    = doc["BASE_MD5"].as<const char *>();
+          const char * image_id    = doc["IMAGE_ID"].as<const char *>();
+          long         chunks      = doc["CHUNKS"].as<long>();
+          long         chunk_size  = doc["CHUNK_SIZE"].as<long>();
+
+          if (compression == NULL) {
+            window = lookahead = 0;
+          }
+
+          // For a shared image, the chunks topic is built now as the strings
+          // of doc are located in the MQTT client buffer, that will be 
+          // overwritten by log()
 
-          if (size && name && md5) {
+          ota_chunk_count = 0;
+          if (image_id != NULL) {
+            snprintf(ota_topic, sizeof(ota_topic), "%s/%s/%s/%s/",
+                     MAISON_PREFIX_TOPIC, MAISON_OTA_TOPIC, APP_NAME, image_id);
+          }
+
+          if (!(size && name && md5)) {
+            OTA_DEBUGLN(F("Error: SIZE, MD5 or APP_NAME not present"));
+            log(F("Error: SIZE, MD5 or APP_NAME not present"));
+          }
+          else if ((compression != NULL) && 
+                   ((strcmp(compression, "HEATSHRINK") != 0) ||
+                    (window    < 4) || (window    > OTA_MAX_WINDOW_BITS) ||
+                    (lookahead < 3) || (lookahead >= window))) {
+            OTA_DEBUGLN(F("Error: Unsupported COMPRESSION, WINDOW or LOOKAHEAD"));
+            log(F("Error: Unsupported COMPRESSION, WINDOW or LOOKAHEAD"));
+          }
+          else if ((delta != NULL) && 
+                   ((strcmp(delta, "BSDIFF43") != 0) || (base_md5 == NULL))) {
+            OTA_DEBUGLN(F("Error: Unsupported DELTA or BASE_MD5 not present"));
+            log(F("Error: Unsupported DELTA or BASE_MD5 not present"));
+          }
+          else if ((image_id != NULL) && 
+                   ((chunks <= 0) || (chunks > 0xFFFF) || (chunk_size <= 0) ||
+                    ((strlen(ota_topic) + 5) >= sizeof(ota_topic)) ||
+                    ((chunk_size + strlen(ota_topic) + 14) > MQTT_MAX_PACKET_SIZE))) {
+            OTA_DEBUGLN(F("Error: Unsupported IMAGE_ID, CHUNKS or CHUNK_SIZE"));
+            log(F("Error: Unsupported IMAGE_ID, CHUNKS or CHUNK_SIZE"));
+          }
+          else if (strcmp(ESP.getSketchMD5().c_str(), md5) == 0) {
+            // A copy of a request already processed, e.g. queued twice by the broker
+            OTA_DEBUGLN(F("Code already running. Upload ignored."));
+            log(F("Info: Code already running (md5: %s). Upload ignored."),
+                ESP.getSketchMD5().c_str());
+          }
+          else if ((delta != NULL) && (strcmp(ESP.getSketchMD5().c_str(), base_md5) != 0)) {
+            OTA_DEBUGLN(F("Error: Code upload aborted. Running code differ from BASE_MD5"));
+            log(F("Error: Code upload aborted. Running code differ from BASE_MD5"));
+          }
+          else {
             OTA_DEBUG(F(" Receive size: "));
             OTA_DEBUGLN(size);
 
             char tmp[33];
 
             if (strcmp(APP_NAME, name) == 0) {
-              if (cons.begin(size, md5)) {
-                mqtt_client.setStream(cons);
-                // log uses buffer too...
+              if (cons.begin(size, md5, window, lookahead, delta != NULL)) {
+                char kind[40];
+
+                snprintf(kind, sizeof(kind), "%s%s%s",
+                         (delta    != NULL) ? ", delta"      : "",
+                         (window   != 0   ) ? ", heatshrink" : "",
+                         (image_id != NULL) ? ", shared"     : "");
+
+                // log overwrites the message...
                 memcpy(tmp, md5, 32);
                 tmp[32] = 0;
+
+                if (image_id != NULL) {
+                  // The code is pulled chunk by chunk from the shared image topic
+                  ota_chunk_count   = chunks;
+                  ota_chunk_size    = chunk_size;
+                  ota_next_chunk    = 0;
+                  ota_chunk_retries = 0;
+                }
+                else {
+                  mqtt_client.setStream(cons);
+                }
+
                 OTA_DEBUG(F("Code update started with size "));
                 OTA_DEBUG(size); 
                 OTA_DEBUG(F(" and ")); 
                 OTA_DEBUGLN(tmp);
-                log(F("Code update started with size %d and md5: %s."), size, tmp);
+                log(F("Code update started with size %d%s%s%s and md5: %s."), 
+                    size, 
+                    kind[0] ? " ("      : "",
+                    kind[0] ? &kind[2] : "",
+                    kind[0] ? ")"      : "",
+                    tmp);
                 wait_for_ota_completion = true;
+
+                if ((ota_chunk_count > 0) && !subscribe_ota_window(true)) {
+                  subscribe_ota_window(false);
+                  cons.abort();
+                  wait_for_ota_completion = false;
+                  OTA_DEBUGLN(F("Error: Code upload aborted. Unable to subscribe to shared image"));
+                  log(F("Error: Code upload aborted. Unable to subscribe to shared image"));
+                }
               }
               else {
                 OTA_DEBUG(F("Error: Code upload not started: "));
@@ -357,7 +1398,7 @@ void Maison::process_callback(const char * _topic, byte * _payload, unsigned int
               }
             }
             else {
-              // log uses buffer too...
+              // log overwrites the message...
               strlcpy(tmp, name, sizeof(tmp));
               OTA_DEBUG(F("Error: Code upload aborted. App name differ ("));
               OTA_DEBUG(APP_NAME);
@@ -367,56 +1408,47 @@ void Maison::process_callback(const char * _topic, byte * _payload, unsigned int
               log(F("Error: Code upload aborted. App name differ (%s vs %s)"), APP_NAME, tmp);
             }
           }
-          else {
-            OTA_DEBUGLN(F("Error: SIZE, MD5 or APP_NAME not present"));
-            log(F("Error: SIZE, MD5 or APP_NAME not present"));
-          }
         }
       }
-      else if (cons.isRunning()) {
+      else if (wait_for_ota_completion && (ota_chunk_count == 0)) {
         // The transmission is expected to be complete. Check if the 
         // Updater is satisfied and if so, restart the device
 
-        yield();
-        
-        if (cons.end()) {
-          OTA_DEBUGLN(F(" Upload Completed. Rebooting..."));
-          log(F("Code upload completed. Rebooting"));
-          reboot_now = true;
-        }
-        else {
-          OTA_DEBUG(F("Error: Code upload not completed: "));
-          OTA_DEBUGLN(cons.getErrorStr().c_str());
-          log(F("Error: Code upload not completed: %s"), 
-              cons.getErrorStr().c_str());
-        }
-        wait_for_ota_completion = false;
+        complete_ota();
       }
       else 
     #endif
 
-    if (strncmp(buffer, "CONFIG:", 7) == 0) {
+    if (is_command(payload, length, "CONFIG:")) {
       NET_DEBUGLN(F(" New config received"));
-      get_new_config();
+      get_new_config(&payload[7], length - 7);
+    }
+    else if (is_command(payload, length, "CONFIG_PATCH:")) {
+      NET_DEBUGLN(F(" Config patch received"));
+      get_config_patch(&payload[13], length - 13);
     }
-    else if (strncmp(buffer, "CONFIG?", 7) == 0) {
+    else if (is_command(payload, length, "CONFIG?")) {
       NET_DEBUGLN(F(" Config content requested"));
       send_config_msg();
     }
-    else if (strncmp(buffer, "STATE?", 6) == 0) {
-      NET_DEBUGLN(F(" Config content requested"));
+    else if (is_command(payload, length, "STATE?")) {
+      NET_DEBUGLN(F(" State content requested"));
       send_state_msg("STATE");
     }
-    else if (strncmp(buffer, "RESTART!!", 9) == 0) {
+    else if (is_command(payload, length, "HEAP?")) {
+      NET_DEBUGLN(F(" Heap content requested"));
+      send_heap_msg();
+    }
+    else if (is_command(payload, length, "RESTART!!")) {
       NET_DEBUGLN("Device is restarting");
       restart_now = true;
     }
-    else if (strncmp(buffer, "REBOOT!", 7) == 0) {
+    else if (is_command(payload, length, "REBOOT!")) {
       NET_DEBUGLN("Device is rebooting");
       reboot_now = true;
     }
     #if NET_TESTING
-      else if (strncmp(buffer, "TEST!", 5) == 0) {
+      else if (is_command(payload, length, "TEST!")) {
         log(F("This is a test..."));
 
         bool res = wifi_client->flush(10);
@@ -450,14 +1482,56 @@ void Maison::loop(Process * _process)
   DEBUGLN(mem.state);
 
   yield();
+  sample_heap();
+  latch_expired_timers();
+
+  // The inputs, samples and tasks are serviced before the network, so they
+  // keep being processed while the device is not connected. A samples
+  // summary made pending here gets the network (see network_is_available()).
 
-  if (network_is_available()) {
+  #if MAISON_INPUTS > 0
+    process_inputs();
+  #endif
+
+  #if MAISON_SAMPLING
+    process_samples();
+  #endif
+
+  run_tasks();
+
+  // On battery power, after a failed connection to the MQTT broker, the
+  // network is not used until the retry time, even if the device wakes
+  // up earlier for a timer.
+
+  bool retry_pending = use_deep_sleep() && 
+                       timer_pending(RETRY_TIMER) && 
+                       !timer_elapsed(RETRY_TIMER);
+
+  // After a reset, the first connection waits for the device startup
+  // delay, to spread the connections of devices rebooting together. When
+  // not on battery power, only the connection is deferred: the device
+  // keeps running without the network until then.
+
+  bool connect_deferred = !use_deep_sleep() && startup_delay_pending();
+
+  if (network_is_available() && !retry_pending && !connect_deferred) {
+
+    if (startup_delay_pending()) delay(startup_delay() - millis());
 
     if (first_connect_trial) {
       first_connect_trial    = false;
       NET_DEBUGLN(F("First Connection Trial"));
       mqtt_connect();
       last_reconnect_attempt = millis();
+
+      // Time from the wake up to MQTT connected, averaged, for the sleep policy
+
+      if (use_deep_sleep() && !is_hard_reset() && !stayed_awake && mqtt_connected()) {
+        uint32_t cost = millis();
+        if (cost > 0xFFFF) cost = 0xFFFF;
+        mem.reconnect_time = (mem.reconnect_time == 0) ? cost 
+                                                       : ((3U * mem.reconnect_time) + cost) / 4;
+      }
     }
 
     if (!mqtt_connected()) {
@@ -476,21 +1550,24 @@ void Maison::loop(Process * _process)
 
       if (use_deep_sleep()) {
         NET_DEBUGLN(F("Unable to connect to MQTT Server. Deep Sleep for 1 hour."));
-        deep_sleep(true, ONE_HOUR);
+        arm_timer(RETRY_TIMER, now() + retry_delay());
+        deep_sleep(true, retry_delay() / 1000);
       }
       else {
         long now = millis();
-        if ((now - last_reconnect_attempt) > (1000L * ONE_HOUR)) {
+        if ((now - last_reconnect_attempt) > (long) retry_delay()) {
           NET_DEBUG(F("\r\nBeen waiting for "));
           NET_DEBUG(ONE_HOUR);
           NET_DEBUGLN(F(" Seconds. Trying again..."));
           if (!mqtt_connect()) {
             last_reconnect_attempt = millis();
+            idle_until_next_task();
             return;
           }
         }
         else {
           NET_DEBUG("-");
+          idle_until_next_task();
           return;
         }
       }
@@ -506,7 +1583,7 @@ void Maison::loop(Process * _process)
     // it may require many calls to mqtt_loop to get it completed. The
     // wait_for_ota_completion flag is set by the callback to signify the need
     // to wait until the new code has been received. The algorithm
-    // below insure that if the code has not been received inside 2 minutes
+    // below insure that if no part of the code has been received inside 2 minutes
     // of wait time, it will be aborted. This is to control battery drain.
 
     uint32_t start = millis();
@@ -528,39 +1605,57 @@ void Maison::loop(Process * _process)
           break;
         }
       }
+
+      if (some_message_received) start = millis();
     } while (some_message_received || 
              (wait_for_ota_completion && ((millis() - start) < 120000)));
 
     if (wait_for_ota_completion) {
       wait_for_ota_completion = false;
+      #if MQTT_OTA
+        cons.abort();
+        if (ota_chunk_count > 0) subscribe_ota_window(false);
+      #endif
       OTA_DEBUGLN(F("Error: Wait for completion too long. Aborted."));
       log(F("Error: Wait for completion too long. Aborted."));
     }
 
+    if (reconnect_needed > CONFIG_IN_PLACE) reconnect();
+
     if (restart_now) restart();
     if (reboot_now) reboot();
   }
 
+  #if MAISON_SAMPLING
+    if (mem.report_pending && mqtt_connected()) send_samples_msg();
+  #endif
+
   new_state        = mem.state;
   new_return_state = mem.return_state;
 
   set_deep_sleep_wait_time(
-    is_short_reboot_time_needed() ? DEFAULT_SHORT_REBOOT_TIME : ONE_HOUR);
+    is_short_reboot_time_needed(mem.state) ? DEFAULT_SHORT_REBOOT_TIME : ONE_HOUR);
 
-  if (use_deep_sleep()) {
-    mem.elapse_time += micros();
+  if (use_deep_sleep() && !stayed_awake) {
+    mem.elapse_time = add_elapse_time(mem.elapse_time, micros());
   }
   else {
     mem.elapse_time  = micros() - loop_time_marker;
   }
   loop_time_marker = micros();
+  stayed_awake     = false;
 
   UserResult res = call_user_process(_process);
 
+  #if MAISON_INPUTS > 0
+    if ((mem.state == WAIT_FOR_EVENT) && new_input_event_pending()) res = NEW_EVENT;
+  #endif
+
   DEBUG(F("User process result: ")); DEBUGLN(res);
 
   switch (mem.state) {
     case STARTUP:
+      if (connect_deferred) break; // The STARTUP message waits for the connection
       send_state_msg("STARTUP");
       if (res != NOT_COMPLETED) {
         new_state        = WAIT_FOR_EVENT;
@@ -627,22 +1722,610 @@ void Maison::loop(Process * _process)
 
   DEBUG(" Next state: "); DEBUGLN(mem.state);
 
+  #if MAISON_EVENT_CHANNELS > 0
+    run_channels();
+  #endif
+
+  #if MAISON_SAMPLING
+    // A pending summary: come back quickly with the network, unless
+    // waiting for a connection retry
+
+    if (use_deep_sleep() && mem.report_pending && 
+        !mqtt_connected() && !timer_pending(RETRY_TIMER)) {
+      deep_sleep_wait_time = 0;
+    }
+  #endif
+
   if (use_deep_sleep()) {
-    deep_sleep(network_is_available(), deep_sleep_wait_time);
+    #if MAISON_HYBRID_SLEEP
+      uint32_t wait_time = (deep_sleep_wait_time ==        0) ? 100 :
+                           (deep_sleep_wait_time > ONE_HOUR) ? (1000U * ONE_HOUR) :
+                                                               (1000U * deep_sleep_wait_time);
+      if (stay_awake(wait_time)) {
+        awake_wait(wait_time);
+      }
+      else {
+        deep_sleep(network_is_available(), deep_sleep_wait_time);
+      }
+    #else
+      deep_sleep(network_is_available(), deep_sleep_wait_time);
+    #endif
   }
   else {
-    mem.one_hour_step_count += millis() - last_time_count;
+    mem.clock += millis() - last_time_count;
     last_time_count = millis();
+    idle_until_next_task();
   }
 
-  DEBUG(F(" One hour step count ("));
-  DEBUG(mem.hours_24_count);
-  DEBUG("): ");
-  DEBUGLN(mem.one_hour_step_count);
+  DEBUG(F(" Clock: "));
+  DEBUGLN(mem.clock);
 
   DEBUGLN("End of Maison::loop()");
 }
 
+#if MAISON_EVENT_CHANNELS > 0
+
+bool Maison::set_channel_process(uint8_t _channel, Process * _process)
+{
+  if (_channel >= MAISON_EVENT_CHANNELS) return false;
+
+  channel_process[_channel] = _process;
+  return true;
+}
+
+// The event channels transitions are the ones of the main finite state
+// machine, without the HOURS_24 state, that belongs to the device.
+
+Maison::State Maison::channel_transition(State _state, UserResult _res)
+{
+  switch (_state) {
+    case STARTUP:
+      return (_res != NOT_COMPLETED) ? WAIT_FOR_EVENT : STARTUP;
+
+    case WAIT_FOR_EVENT:
+      return (_res == NEW_EVENT) ? PROCESS_EVENT : WAIT_FOR_EVENT;
+
+    case PROCESS_EVENT:
+      if (_res == ABORTED) return WAIT_FOR_EVENT;
+      return (_res != NOT_COMPLETED) ? WAIT_END_EVENT : PROCESS_EVENT;
+
+    case WAIT_END_EVENT:
+      if (_res == RETRY) return PROCESS_EVENT;
+      return (_res != NOT_COMPLETED) ? END_EVENT : WAIT_END_EVENT;
+
+    case END_EVENT:
+      return (_res != NOT_COMPLETED) ? WAIT_FOR_EVENT : END_EVENT;
+
+    default:
+      return WAIT_FOR_EVENT;
+  }
+}
+
+// Call the channels process functions and update their state. Each
+// channel gets the default Deep Sleep period of its state, that its
+// process function may change. The shortest period of the main finite
+// state machine and the channels is kept, so they share the wake ups
+// (and the network session, see network_is_available()).
+
+void Maison::run_channels()
+{
+  uint32_t wait_time = deep_sleep_wait_time;
+
+  for (uint8_t i = 0; i < MAISON_EVENT_CHANNELS; i++) {
+    if (channel_process[i] == NULL) continue;
+
+    State state = mem.channel_states[i];
+
+    set_deep_sleep_wait_time(
+      is_short_reboot_time_needed(state) ? DEFAULT_SHORT_REBOOT_TIME : ONE_HOUR);
+
+    DEBUG(F("Calling channel process ")); DEBUGLN(i);
+
+    UserResult res = (*channel_process[i])(state);
+
+    mem.channel_states[i] = channel_transition(state, res);
+
+    DEBUG(F(" Channel next state: ")); DEBUGLN(mem.channel_states[i]);
+
+    if (deep_sleep_wait_time < wait_time) wait_time = deep_sleep_wait_time;
+  }
+
+  deep_sleep_wait_time = wait_time;
+}
+
+#endif
+
+#if MAISON_INPUTS > 0
+
+static_assert(MAISON_INPUTS <= 4, "MAISON_INPUTS must be at most 4");
+static_assert((MAISON_INPUT_BUFFER_SIZE & (MAISON_INPUT_BUFFER_SIZE - 1)) == 0,
+              "MAISON_INPUT_BUFFER_SIZE must be a power of 2");
+static_assert(MAISON_INPUT_BUFFER_SIZE <= 256, "MAISON_INPUT_BUFFER_SIZE must be at most 256");
+
+// The edges captured by the GPIO interrupt handlers. The ring buffer has a
+// single producer, the interrupt handlers, that only update edge_head, and a
+// single consumer, Maison::loop(), that only updates edge_tail: no lock is
+// required. Edges are dropped when the buffer is full.
+
+struct input_edge {
+  uint32_t time;    // millis() value
+  uint8_t  input;
+  uint8_t  level;
+};
+
+static volatile input_edge edges[MAISON_INPUT_BUFFER_SIZE];
+static volatile uint8_t    edge_head = 0;
+static volatile uint8_t    edge_tail = 0;
+static uint8_t             input_pins[MAISON_INPUTS];
+
+static inline void ICACHE_RAM_ATTR capture_edge(uint8_t _input)
+{
+  uint8_t head = edge_head;
+  uint8_t next = (head + 1) & (MAISON_INPUT_BUFFER_SIZE - 1);
+
+  if (next != edge_tail) {
+    edges[head].time  = millis();
+    edges[head].input = _input;
+    edges[head].level = digitalRead(input_pins[_input]);
+    edge_head = next;
+  }
+
+  // The light sleep wake up trigger is a level interrupt, raised again as
+  // long as the level holds: the edge trigger is restored at once.
+
+  uint8_t pin = input_pins[_input];
+
+  if (GPC(pin) & (1 << GPCWE)) {
+    GPC(pin) = (GPC(pin) & ~((0xF << GPCI) | (1 << GPCWE))) | (CHANGE << GPCI);
+  }
+}
+
+template <uint8_t N> static void ICACHE_RAM_ATTR input_isr() { capture_edge(N); }
+
+extern "C" {
+  #include <user_interface.h>
+}
+
+// With the LIGHT_SLEEP feature, the CPU is woken up from light sleep when
+// an input leaves its debounced level. This replaces the edge trigger of
+// the input interrupt, restored by capture_edge() when it is raised: the
+// wake up is armed again before each wait.
+
+static void enable_input_wakeup(uint8_t _pin, uint8_t _stable_level)
+{
+  wifi_enable_gpio_wakeup(_pin, (_stable_level == LOW) ? GPIO_PIN_INTR_HILEVEL 
+                                                       : GPIO_PIN_INTR_LOLEVEL);
+}
+
+static void (* const input_isrs[4])() = {
+  input_isr<0>, input_isr<1>, input_isr<2>, input_isr<3>
+};
+
+int8_t Maison::add_input(uint8_t _pin, bool _active_low, bool _new_event)
+{
+  if (input_count >= MAISON_INPUTS) {
+    DEBUGLN(F(" ERROR: Too many inputs"));
+    return -1;
+  }
+
+  input_struct & in = inputs[input_count];
+
+  in.pin          = _pin;
+  in.active_low   = _active_low;
+  in.new_event    = _new_event;
+  in.stable_level = in.last_level = digitalRead(_pin);
+  in.last_edge    = millis();
+
+  input_pins[input_count] = _pin;
+  attachInterrupt(digitalPinToInterrupt(_pin), input_isrs[input_count], CHANGE);
+
+  return input_count++;
+}
+
+// Consume the captured edges and queue an event for each input that
+// changed and stayed stable for MAISON_INPUT_DEBOUNCE milliseconds.
+
+void Maison::process_inputs()
+{
+  while (edge_tail != edge_head) {
+    uint8_t tail = edge_tail;
+    input_struct & in = inputs[edges[tail].input];
+
+    in.last_level = edges[tail].level;
+    in.last_edge  = edges[tail].time;
+
+    edge_tail = (tail + 1) & (MAISON_INPUT_BUFFER_SIZE - 1);
+  }
+
+  for (uint8_t i = 0; i < input_count; i++) {
+    input_struct & in = inputs[i];
+
+    // Catch up with edges dropped when the buffer was full
+
+    uint8_t level = digitalRead(in.pin);
+    if ((level != in.last_level) && (edge_tail == edge_head)) {
+      in.last_level = level;
+      in.last_edge  = millis();
+    }
+
+    if ((in.last_level != in.stable_level) && 
+        ((millis() - in.last_edge) >= MAISON_INPUT_DEBOUNCE)) {
+      in.stable_level = in.last_level;
+
+      uint8_t next = (input_event_head + 1) & (MAISON_INPUT_BUFFER_SIZE - 1);
+      if (next == input_event_tail) {
+        DEBUGLN(F(" Input events queue full, event dropped"));
+      }
+      else {
+        InputEvent & event = input_events[input_event_head];
+        event.input  = i;
+        event.active = (in.stable_level == LOW) == in.active_low;
+        event.time   = in.last_edge;
+        input_event_head = next;
+      }
+    }
+  }
+}
+
+// Returns the number of milliseconds before the inputs that changed are
+// debounced, 0xFFFFFFFF if all inputs are stable.
+
+uint32_t Maison::time_to_debounce()
+{
+  uint32_t next = 0xFFFFFFFF;
+
+  for (uint8_t i = 0; i < input_count; i++) {
+    if (inputs[i].last_level != inputs[i].stable_level) {
+      uint32_t elapsed = millis() - inputs[i].last_edge;
+      if (elapsed >= MAISON_INPUT_DEBOUNCE) return 0;
+      if ((MAISON_INPUT_DEBOUNCE - elapsed) < next) next = MAISON_INPUT_DEBOUNCE - elapsed;
+    }
+  }
+
+  return next;
+}
+
+bool Maison::new_input_event_pending()
+{
+  for (uint8_t i = input_event_tail; i != input_event_head; i = (i + 1) & (MAISON_INPUT_BUFFER_SIZE - 1)) {
+    if (inputs[input_events[i].input].new_event) return true;
+  }
+  return false;
+}
+
+bool Maison::get_input_event(InputEvent & _event)
+{
+  if (input_event_tail == input_event_head) return false;
+
+  _event = input_events[input_event_tail];
+  input_event_tail = (input_event_tail + 1) & (MAISON_INPUT_BUFFER_SIZE - 1);
+
+  return true;
+}
+
+bool Maison::input_is_active(uint8_t _input)
+{
+  return (_input < input_count) && 
+         ((inputs[_input].stable_level == LOW) == inputs[_input].active_low);
+}
+
+#endif
+
+#if MAISON_SAMPLING
+
+// ---- Sample Aggregation ----
+
+// The sampling and reporting intervals are kept in RTC memory with their
+// timers: as the application sets them at every wake up, the timers are
+// only restarted when an interval changes.
+
+void Maison::set_sampling_interval(Sampler * _sampler, uint32_t _seconds)
+{
+  sampler = _sampler;
+
+  if ((_seconds != mem.sample_period) || 
+      ((_seconds != 0) && !timer_pending(SAMPLE_TIMER))) {
+    mem.sample_period = _seconds;
+    if (_seconds == 0) {
+      mem.timers_armed &= ~(1 << SAMPLE_TIMER);
+    }
+    else {
+      arm_timer(SAMPLE_TIMER, now() + (1000U * _seconds));
+    }
+  }
+}
+
+void Maison::set_reporting_interval(uint32_t _seconds)
+{
+  if ((_seconds != mem.report_period) || 
+      ((_seconds != 0) && !timer_pending(REPORT_TIMER))) {
+    mem.report_period = _seconds;
+    if (_seconds == 0) {
+      mem.timers_armed &= ~(1 << REPORT_TIMER);
+    }
+    else {
+      arm_timer(REPORT_TIMER, now() + (1000U * _seconds));
+    }
+  }
+}
+
+void Maison::add_sample(int16_t _value)
+{
+  if (mem.sample_count == 0xFFFF) return;
+
+  if ((mem.sample_count == 0) || (_value < mem.sample_min)) mem.sample_min = _value;
+  if ((mem.sample_count == 0) || (_value > mem.sample_max)) mem.sample_max = _value;
+
+  #if MAISON_SAMPLE_SERIES > 0
+    mem.series[mem.sample_count % MAISON_SAMPLE_SERIES] = _value;
+  #endif
+
+  mem.sample_sum   += _value;
+  mem.sample_count += 1;
+}
+
+// Re-arm a periodic timer from its last deadline, to keep its phase. If
+// the deadline is late by more than a period, the missed ones are skipped.
+
+void Maison::rearm_timer(uint8_t _timer, uint32_t _period_ms)
+{
+  uint32_t deadline = mem.timers[_timer] + _period_ms;
+
+  if ((int32_t)(deadline - now()) <= 0) deadline = now() + _period_ms;
+
+  arm_timer(_timer, deadline);
+}
+
+// Called by loop() at every wake up, before the network is serviced. A
+// summary due is kept pending until loop() publishes it once connected:
+// network_is_available() is then true. On battery power, a summary due on
+// a wake up without network gets the next wake up done with the network.
+
+void Maison::process_samples()
+{
+  if (timer_elapsed(SAMPLE_TIMER)) {
+    rearm_timer(SAMPLE_TIMER, 1000U * mem.sample_period);
+
+    int16_t value;
+    if ((sampler != NULL) && (*sampler)(value)) add_sample(value);
+  }
+
+  if (timer_elapsed(REPORT_TIMER)) {
+    rearm_timer(REPORT_TIMER, 1000U * mem.report_period);
+    if (mem.sample_count > 0) mem.report_pending = true;
+  }
+}
+
+// The series is sent oldest sample first, as the first sample followed by
+// the differences between consecutive samples, which are usually short.
+
+void Maison::send_samples_msg()
+{
+  #if MAISON_SAMPLE_SERIES > 0
+    char     series[(7 * MAISON_SAMPLE_SERIES) + 16];
+    uint16_t count = (mem.sample_count < MAISON_SAMPLE_SERIES) ? mem.sample_count : MAISON_SAMPLE_SERIES;
+    uint16_t index = (mem.sample_count - count) % MAISON_SAMPLE_SERIES;
+    int16_t  previous = 0;
+    int      length;
+
+    length = snprintf(series, sizeof(series), ",\"series\":[");
+    for (uint16_t i = 0; i < count; i++) {
+      int16_t value = mem.series[index];
+      length += snprintf(&series[length], sizeof(series) - length, 
+                         (i == 0) ? "%d" : ",%d", 
+                         (i == 0) ? value : (value - previous));
+      previous = value;
+      index    = (index + 1) % MAISON_SAMPLE_SERIES;
+    }
+    snprintf(&series[length], sizeof(series) - length, "]");
+  #else
+    const char * series = "";
+  #endif
+
+  bool result = send_msg(
+    MAISON_EVENT_TOPIC,
+    F("{"
+       "\"device\":\"%s\""
+      ",\"msg_type\":\"SAMPLES\""
+      ",\"period\":%u"
+      ",\"count\":%u"
+      ",\"min\":%d"
+      ",\"max\":%d"
+      ",\"mean\":%.2f"
+      "%s"
+    "}"),
+    config.device_name,
+    mem.report_period,
+    mem.sample_count,
+    mem.sample_min,
+    mem.sample_max,
+    (double) mem.sample_sum / mem.sample_count,
+    series);
+
+  if (result) {
+    mem.sample_count   = 0;
+    mem.sample_sum     = 0;
+    mem.report_pending = false;
+  }
+}
+
+#endif
+
+#if MAISON_HYBRID_SLEEP
+
+// A Deep Sleep period tears down the MQTT connection: it must be rebuilt
+// at the next networked wake up. Waiting awake, with the connection kept
+// open, costs less energy if the wait is shorter than the reconnection
+// time multiplied by the ratio of the current drawn while connecting to
+// the current drawn while waiting. A wait is never done awake before the
+// reconnection time has been measured.
+
+bool Maison::stay_awake(uint32_t _wait_time)
+{
+  if (!mqtt_connected() || (mem.reconnect_time == 0)) return false;
+
+  return _wait_time < ((uint32_t) mem.reconnect_time * MAISON_RECONNECT_COST_RATIO);
+}
+
+// Wait with the connection open, in delay() as it lets the modem sleep,
+// still servicing the MQTT connection. The wait ends at the earliest
+// timer deadline, as deep_sleep() would.
+
+void Maison::awake_wait(uint32_t _wait_time)
+{
+  DEBUG(F(" Waiting awake (ms): ")); DEBUGLN(_wait_time);
+
+  uint32_t next_timer = time_to_next_timer();
+  if (next_timer < _wait_time) _wait_time = next_timer;
+
+  uint32_t start = millis();
+  while ((millis() - start) < _wait_time) {
+    if (mqtt_connected()) mqtt_loop();
+    delay(((_wait_time - (millis() - start)) < 100) ? 10 : 100);
+  }
+
+  stayed_awake = true;
+
+  // The connection will be rebuilt if it was lost during the wait
+
+  if (!mqtt_connected()) first_connect_trial = true;
+}
+
+#endif
+
+int8_t Maison::add_task(Task * _task, uint32_t _period_ms, uint32_t _delay_ms)
+{
+  for (int8_t i = 0; i < MAISON_MAX_TASKS; i++) {
+    if (tasks[i].task == NULL) {
+      memset(&tasks[i], 0, sizeof(task_struct));
+      tasks[i].task     = _task;
+      tasks[i].period   = _period_ms;
+      tasks[i].next_run = millis() + _delay_ms;
+      return i;
+    }
+  }
+
+  DEBUGLN(F(" ERROR: Too many tasks"));
+  return -1;
+}
+
+void Maison::remove_task(int8_t _task_id)
+{
+  if ((_task_id >= 0) && (_task_id < MAISON_MAX_TASKS)) {
+    tasks[_task_id].task = NULL;
+  }
+}
+
+bool Maison::get_task_stats(int8_t _task_id, TaskStats & _stats)
+{
+  if ((_task_id < 0) || (_task_id >= MAISON_MAX_TASKS) || (tasks[_task_id].task == NULL)) {
+    return false;
+  }
+
+  _stats = tasks[_task_id].stats;
+  return true;
+}
+
+// Run the tasks that are due. A periodic task that is late is run only
+// once, its next run being computed from the current time.
+
+void Maison::run_tasks()
+{
+  for (int i = 0; i < MAISON_MAX_TASKS; i++) {
+    task_struct & t = tasks[i];
+
+    if ((t.task == NULL) || ((int32_t)(millis() - t.next_run) < 0)) continue;
+
+    Task * task = t.task;
+
+    if (t.period == 0) {
+      t.task = NULL;
+    }
+    else {
+      t.next_run += t.period;
+      if ((int32_t)(millis() - t.next_run) >= 0) t.next_run = millis() + t.period;
+    }
+
+    uint32_t start = micros();
+    (*task)();
+    uint32_t duration = micros() - start;
+
+    t.stats.run_count  += 1;
+    t.stats.total_time += duration;
+    if (duration > t.stats.max_time) t.stats.max_time = duration;
+
+    yield();
+  }
+}
+
+// Wait for the next task deadline, in delay() as it lets the SDK put the
+// CPU to sleep. Without the LIGHT_SLEEP feature, nothing is done if no task
+// is registered, to not slow down the applications that use their own loop.
+//
+// With LIGHT_SLEEP, the WiFi modem is in light sleep (set at connection
+// time) and the wait lasts until the next task or timer deadline, but no
+// more than half the MQTT keepalive period, for the connection to be kept
+// alive. It ends sooner when data is received or an input changes.
+//
+// The wait never goes past the end of the debounce period of an input
+// that changed, for its event to be queued in time.
+
+void Maison::idle_until_next_task()
+{
+  bool     light_sleep = use_light_sleep();
+  uint32_t wait        = light_sleep ? (500U * MQTT_KEEPALIVE) : MAISON_TASK_MAX_IDLE;
+  bool     some_task   = false;
+
+  for (int i = 0; i < MAISON_MAX_TASKS; i++) {
+    if (tasks[i].task != NULL) {
+      int32_t remaining = tasks[i].next_run - millis();
+      if (remaining <= 0) return;
+      if ((uint32_t) remaining < wait) wait = remaining;
+      some_task = true;
+    }
+  }
+
+  #if MAISON_INPUTS > 0
+    uint32_t debounce = time_to_debounce();
+    if (debounce == 0) return;
+    if (debounce < wait) wait = debounce;
+  #endif
+
+  if (startup_delay_pending() && ((startup_delay() - millis()) < wait)) {
+    wait = startup_delay() - millis();
+  }
+
+  if (light_sleep) {
+    uint32_t next_timer = time_to_next_timer();
+    if (next_timer < wait) wait = next_timer;
+
+    #if MAISON_INPUTS > 0
+      for (uint8_t i = 0; i < input_count; i++) {
+        if (inputs[i].last_level == inputs[i].stable_level) {
+          enable_input_wakeup(inputs[i].pin, inputs[i].stable_level);
+        }
+      }
+    #endif
+
+    uint32_t start = millis();
+    while (((millis() - start) < wait) && !wake_up_needed()) {
+      delay(MAISON_LIGHT_SLEEP_POLL);
+    }
+  }
+  else if (some_task) {
+    delay(wait);
+  }
+}
+
+bool Maison::wake_up_needed()
+{
+  #if MAISON_INPUTS > 0
+    if (edge_head != edge_tail) return true;
+  #endif
+
+  return (wifi_client != NULL) && (wifi_client->available() > 0);
+}
+
 #define GETS(dst, src, size)                 \
   if ((tmp = src)) {                         \
     strlcpy(dst, tmp, size);                 \
@@ -665,6 +2348,11 @@ void Maison::loop(Process * _process)
 
 #define GETA(dst, src, size) copyArray(src, dst)
 
+// The TLS receive buffer must be able to hold a TLS fragment: 512 to 16384
+// bytes, or 0 for the default.
+
+#define TLS_BUFFER_VALID(size) (((size) == 0) || (((size) >= 512) && ((size) <= 16384)))
+
 #define GETIP(dst, src) \
   if (!str2ip(src, &dst)) \
     JSON_ERROR(" Bad IP Address or Mask format for " STRINGIZE(dst))
@@ -690,43 +2378,250 @@ bool Maison::retrieve_config(JsonObject _doc, Config & _config)
     GETIP(_config.gateway,          _doc["gateway"         ]);
     GETIP(_config.dns,              _doc["dns"             ]);
 
-    OK_DO;
+    if (!TLS_BUFFER_VALID(_doc["mqtt_tls_buffer"].as<long>())) {
+      JSON_ERROR(" mqtt_tls_buffer out of range (512..16384)")
+    }
+
+    _config.mqtt_tls_buffer = _doc["mqtt_tls_buffer"].as<int>();  // Optional, 0 if absent
+    _config.report_offset   = _doc["report_offset"  ].as<long>(); // Optional, 0 if absent
+
+    OK_DO;
+  }
+
+  JSON_SHOW_RESULT("retrieve_config()");
+
+  return result;
+}
+
+// For config patches, a member set to null resets the field to an
+// empty string, 0 or 0.0.0.0. Members not present are left unchanged.
+
+#define PATCHS(dst, key)                                                   \
+  if (_patch.containsKey(key)) {                                           \
+    JsonVariant value = _patch[key];                                       \
+    if (value.isNull()) dst[0] = 0;                                        \
+    else if (value.is<const char *>())                                     \
+      strlcpy(dst, value.as<const char *>(), sizeof(dst));                 \
+    else JSON_ERROR(" Bad value type for " key)                            \
+  }
+
+#define PATCHI(dst, key)                                                   \
+  if (_patch.containsKey(key)) {                                           \
+    JsonVariant value = _patch[key];                                       \
+    if (value.isNull()) dst = 0;                                           \
+    else if (value.is<int>()) dst = value.as<int>();                       \
+    else JSON_ERROR(" Bad value type for " key)                            \
+  }
+
+#define PATCHIP(dst, key)                                                  \
+  if (_patch.containsKey(key)) {                                           \
+    JsonVariant value = _patch[key];                                       \
+    if (value.isNull()) dst = 0;                                           \
+    else if (!value.is<const char *>() ||                                  \
+             !str2ip(value.as<const char *>(), &dst))                      \
+      JSON_ERROR(" Bad IP Address or Mask format for " key)                \
+  }
+
+#define PATCHA(dst, key)                                                   \
+  if (_patch.containsKey(key)) {                                           \
+    JsonVariant value = _patch[key];                                       \
+    memset(dst, 0, sizeof(dst));                                           \
+    if (value.is<JsonArray>()) copyArray(value.as<JsonArray>(), dst);      \
+    else if (!value.isNull()) JSON_ERROR(" Bad value type for " key)       \
+  }
+
+bool Maison::patch_config(JsonObject _patch, Config & _config)
+{
+  JSON_SHOW("patch_config()");
+
+  DO {
+    _config.version = _patch["version"].as<int>();
+
+    PATCHS (_config.device_name,      "device_name"     );
+    PATCHS (_config.wifi_ssid,        "ssid"            );
+    PATCHS (_config.wifi_password,    "wifi_password"   );
+    PATCHS (_config.mqtt_server,      "mqtt_server_name");
+    PATCHS (_config.mqtt_username,    "mqtt_user_name"  );
+    PATCHS (_config.mqtt_password,    "mqtt_password"   );
+    PATCHI (_config.mqtt_port,        "mqtt_port"       );
+    PATCHA (_config.mqtt_fingerprint, "mqtt_fingerprint");
+    if (!TLS_BUFFER_VALID(_patch["mqtt_tls_buffer"].as<long>())) {
+      JSON_ERROR(" mqtt_tls_buffer out of range (512..16384)")
+    }
+
+    PATCHI (_config.mqtt_tls_buffer,  "mqtt_tls_buffer" );
+    PATCHI (_config.report_offset,    "report_offset"   );
+    PATCHIP(_config.ip,               "ip"              );
+    PATCHIP(_config.subnet_mask,      "subnet_mask"     );
+    PATCHIP(_config.gateway,          "gateway"         );
+    PATCHIP(_config.dns,              "dns"             );
+
+    OK_DO;
+  }
+
+  JSON_SHOW_RESULT("patch_config()");
+
+  return result;
+}
+
+#define CONFIG_FILE          "/config.json" // Initial config, as uploaded with the file system
+#define CONFIG_JOURNAL       "/config.jnl"
+#define CONFIG_JOURNAL_TMP   "/config.tmp"
+#define CONFIG_JOURNAL_MAGIC 0x4d434a31
+
+// Scan the config journal for valid records. The offsets of the last
+// CONFIG_JOURNAL_KEEP valid records are put in the _offsets ring and the
+// count of valid records is returned. The scan stops at the first damaged
+// record (e.g. a write interrupted by a reset). The end of the valid records
+// is returned in _end.
+
+int Maison::scan_config_journal(File & _file, uint32_t * _offsets, uint32_t & _end)
+{
+  config_record_header header;
+  uint8_t  chunk[64];
+  int      count = 0;
+  uint32_t pos   = 0;
+  uint32_t size  = _file.size();
+
+  _file.seek(0);
+
+  while ((pos + sizeof(header)) <= size) {
+    if ((_file.read((uint8_t *) &header, sizeof(header)) != sizeof(header)) ||
+        (header.magic != CONFIG_JOURNAL_MAGIC) ||
+        ((pos + sizeof(header) + header.length) > size)) {
+      break;
+    }
+
+    uint32_t crc = 0xffffffff;
+
+    for (uint16_t left = header.length; left > 0; ) {
+      uint16_t n = (left < sizeof(chunk)) ? left : sizeof(chunk);
+      if (_file.read(chunk, n) != n) {
+        crc = ~header.crc;
+        break;
+      }
+      crc   = CRC32(chunk, n, crc);
+      left -= n;
+    }
+
+    if (crc != header.crc) break;
+
+    _offsets[count++ % CONFIG_JOURNAL_KEEP] = pos;
+    pos += sizeof(header) + header.length;
+  }
+
+  _end = pos;
+
+  JSON_DEBUG(F(" Valid config journal records: "));
+  JSON_DEBUGLN(count);
+
+  return count;
+}
+
+// Open the config _index versions before the current one (0 is the current
+// config) and set the file position at the beginning of its content. The
+// initial config file is only used when the journal holds no valid record:
+// after a compaction, it is not the version preceding the oldest record.
+// Its header crc is 0 as it is not known.
+
+bool Maison::open_config(File & _file, int _index, config_record_header & _header)
+{
+  uint32_t offsets[CONFIG_JOURNAL_KEEP];
+  uint32_t end;
+  int      count = 0;
+
+  // A compaction interrupted before its end
+
+  if (!SPIFFS.exists(CONFIG_JOURNAL) && SPIFFS.exists(CONFIG_JOURNAL_TMP)) {
+    SPIFFS.rename(CONFIG_JOURNAL_TMP, CONFIG_JOURNAL);
   }
 
-  JSON_SHOW_RESULT("retrieve_config()");
+  if (SPIFFS.exists(CONFIG_JOURNAL) && (_file = SPIFFS.open(CONFIG_JOURNAL, "r"))) {
+    count = scan_config_journal(_file, offsets, end);
 
-  return result;
+    if ((_index < count) && (_index < CONFIG_JOURNAL_KEEP)) {
+      _file.seek(offsets[(count - 1 - _index) % CONFIG_JOURNAL_KEEP]);
+      return _file.read((uint8_t *) &_header, sizeof(_header)) == sizeof(_header);
+    }
+
+    _file.close();
+  }
+
+  if ((_index == 0) && (count == 0) && SPIFFS.exists(CONFIG_FILE) && (_file = SPIFFS.open(CONFIG_FILE, "r"))) {
+    _header.magic   = 0;
+    _header.version = 0;
+    _header.length  = (_file.size() < 0xFFFF) ? _file.size() : 0xFFFF;
+    _header.crc     = 0;
+    return true;
+  }
+
+  return false;
 }
 
-bool Maison::load_config(int _file_version)
+bool Maison::load_config(int _index)
 {
   File file;
-  char the_filename[32];
-  char str[20];
+  config_record_header header;
 
   JSON_SHOW("load_config()");
 
-  if (_file_version == 0) {
-    strlcpy(the_filename, "/config.json", sizeof(the_filename));
-  }
-  else {
-    strlcpy(the_filename, "/config_",                   sizeof(the_filename));
-    strlcat(the_filename, itoa(_file_version, str, 10), sizeof(the_filename));
-    strlcat(the_filename, ".json",                      sizeof(the_filename));
-  }
+  #if JSON_TESTING
+    uint32_t start = micros();
+  #endif
+
+  #if MAISON_CONFIG_CACHE
+    // On a Deep Sleep return, the config is retrieved from RTC memory
+    // without accessing the file system
+
+    if ((_index == 0) && !is_hard_reset() && read_config_cache(0)) {
+      JSON_DEBUG(F(" Config retrieved from RTC memory in "));
+      JSON_DEBUG(micros() - start);
+      JSON_DEBUGLN(F(" us"));
+      #if JSON_TESTING
+        show_config(config);
+      #endif
+      return true;
+    }
+  #endif
 
-  JSON_DEBUG(F(" Config filename: "));
-  JSON_DEBUGLN(the_filename);
+  JSON_DEBUG(F(" Config index: "));
+  JSON_DEBUGLN(_index);
 
   DO {
-    if (!SPIFFS.begin())              JSON_ERROR("SPIFFS.begin() not working");
-    if (!SPIFFS.exists(the_filename)) JSON_ERROR("Config file does not esists");
+    if (!SPIFFS.begin())                        JSON_ERROR("SPIFFS.begin() not working");
+    if (!open_config(file, _index, header))     JSON_ERROR("Config not found");
+
+    JsonDocument & doc = get_json_doc();
+    DeserializationError error;
 
-    file = SPIFFS.open(the_filename, "r");
-    if (!file) JSON_ERROR("Unable to open file");
+    if (header.length < SCRATCH_TEXT_SIZE) {
+      if (file.read((uint8_t *) scratch_text, header.length) != header.length) {
+        JSON_ERROR("Unable to read config");
+      }
+      scratch_text[header.length] = 0;
+
+      if (header.crc == 0) header.crc = CRC32((uint8_t *) scratch_text, header.length);
+
+      #if MAISON_CONFIG_CACHE
+        // The config parsing is not required if the config didn't change
+        // since the cache was built (e.g. after a reset button push)
+
+        if ((_index == 0) && read_config_cache(header.crc)) {
+          JSON_DEBUGLN(F(" Config unchanged. Retrieved from RTC memory"));
+          OK_DO;
+        }
+      #endif
+
+      error = deserializeJson(doc, scratch_text, header.length);
+    }
+    else {
+      // Larger than the scratch buffer (only the initial config file can be,
+      // the journal records are compact): parsed from the file stream. Its
+      // CRC stays unknown (0), so the cache is not used to skip the parsing.
 
-    DynamicJsonDocument doc(2048);
-    DeserializationError error = deserializeJson(doc, file);
+      JSON_DEBUGLN(F(" Large config. Parsed from the file stream"));
+      error = deserializeJson(doc, file);
+    }
 
     if (error) JSON_ERROR("Unable to parse JSON content");
 
@@ -734,11 +2629,19 @@ bool Maison::load_config(int _file_version)
       JSON_ERROR("Unable to read config elements");
     }
 
+    #if MAISON_CONFIG_CACHE
+      if (_index == 0) write_config_cache(header.crc);
+    #endif
+
     OK_DO;
   }
 
   file.close();
 
+  JSON_DEBUG(F(" Config retrieved from file in "));
+  JSON_DEBUG(micros() - start);
+  JSON_DEBUGLN(F(" us"));
+
   #if JSON_TESTING
     if (result) show_config(config);
   #endif
@@ -748,30 +2651,86 @@ bool Maison::load_config(int _file_version)
   return result;
 }
 
+// Rewrite the journal with its last CONFIG_JOURNAL_KEEP - 1 valid records,
+// to leave room for a new one. Damaged records are dropped.
+
+bool Maison::compact_config_journal()
+{
+  File     from, to;
+  uint32_t offsets[CONFIG_JOURNAL_KEEP];
+  uint32_t end;
+  uint8_t  chunk[64];
+
+  JSON_SHOW("compact_config_journal()");
+
+  DO {
+    from = SPIFFS.open(CONFIG_JOURNAL, "r");
+    if (!from) JSON_ERROR("Unable to open config journal");
+
+    to = SPIFFS.open(CONFIG_JOURNAL_TMP, "w");
+    if (!to) JSON_ERROR("Unable to create config journal copy");
+
+    int  count = scan_config_journal(from, offsets, end);
+    int  i     = (count > (CONFIG_JOURNAL_KEEP - 1)) ? (count - (CONFIG_JOURNAL_KEEP - 1)) : 0;
+    bool ok    = true;
+
+    for (; ok && (i < count); i++) {
+      config_record_header header;
+
+      from.seek(offsets[i % CONFIG_JOURNAL_KEEP]);
+
+      ok = (from.read((uint8_t *) &header, sizeof(header)) == sizeof(header)) &&
+           (to.write((uint8_t *) &header, sizeof(header)) == sizeof(header));
+      config_bytes_written += sizeof(header);
+
+      for (uint16_t left = header.length; ok && (left > 0); ) {
+        uint16_t n = (left < sizeof(chunk)) ? left : sizeof(chunk);
+
+        ok = (from.read(chunk, n) == n) && (to.write(chunk, n) == n);
+        config_bytes_written += n;
+        left -= n;
+      }
+    }
+
+    if (!ok) JSON_ERROR("Unable to copy config journal records");
+
+    from.close();
+    to.close();
+
+    if (!SPIFFS.remove(CONFIG_JOURNAL))                     JSON_ERROR("Unable to remove config journal");
+    if (!SPIFFS.rename(CONFIG_JOURNAL_TMP, CONFIG_JOURNAL)) JSON_ERROR("Unable to rename config journal");
+
+    OK_DO;
+  }
+
+  from.close();
+  to.close();
+
+  JSON_SHOW_RESULT("compact_config_journal()");
+
+  return result;
+}
+
 #define PUT(src, dst) dst = src
 #define PUTA(src, dst, len) copyArray(src, dst)
-#define PUTIP(src, dst) ip2str(src, buffer, 50); dst = buffer;
+#define PUTIP(src, dst) ip2str(src, scratch_text, 50); dst = scratch_text;
+
+// The config is appended to the journal as a new record. The number of
+// flash bytes written, compaction included, is kept in config_bytes_written.
 
 bool Maison::save_config()
 {
   File file;
+  config_record_header header;
 
   JSON_SHOW("save_config()");
 
+  config_bytes_written = 0;
+
   DO {
     if (!SPIFFS.begin()) ERROR(" SPIFFS.begin() not working");
-    if (SPIFFS.exists("/config_5.json")) SPIFFS.remove("/config_5.json");
-    if (SPIFFS.exists("/config_4.json")) SPIFFS.rename("/config_4.json", "/config_5.json");
-    if (SPIFFS.exists("/config_3.json")) SPIFFS.rename("/config_3.json", "/config_4.json");
-    if (SPIFFS.exists("/config_2.json")) SPIFFS.rename("/config_2.json", "/config_3.json");
-    if (SPIFFS.exists("/config_1.json")) SPIFFS.rename("/config_1.json", "/config_2.json");
-    if (SPIFFS.exists("/config.json"  )) SPIFFS.rename("/config.json",   "/config_1.json");
-
-    file = SPIFFS.open("/config.json", "w");
 
-    if (!file) JSON_ERROR("Unable to open file /config.json");
-
-    DynamicJsonDocument doc(2048);
+    JsonDocument & doc = get_json_doc();
 
     JsonArray arr = doc.createNestedArray("mqtt_fingerprint");
     //if (!arr.success()) ERROR("Unable to create JSON array object");
@@ -788,15 +2747,58 @@ bool Maison::save_config()
     PUT  (config.mqtt_username,    doc["mqtt_user_name"  ]);
     PUT  (config.mqtt_password,    doc["mqtt_password"   ]);
     PUT  (config.mqtt_port,        doc["mqtt_port"       ]);
+    PUT  (config.mqtt_tls_buffer,  doc["mqtt_tls_buffer" ]);
+    PUT  (config.report_offset,    doc["report_offset"   ]);
     PUTA (config.mqtt_fingerprint, arr, 20);
 
-    serializeJson(doc, file);
+    header.magic   = CONFIG_JOURNAL_MAGIC;
+    header.version = config.version;
+    header.length  = serializeJson(doc, scratch_text, SCRATCH_TEXT_SIZE);
+    header.crc     = CRC32((uint8_t *) scratch_text, header.length);
+
+    if ((header.length == 0) || (header.length >= (SCRATCH_TEXT_SIZE - 1))) {
+      JSON_ERROR("Config too large");
+    }
+
+    // The journal is compacted when full or when it ends with a damaged
+    // record, as records appended after it would not be reachable.
+
+    if (SPIFFS.exists(CONFIG_JOURNAL) && (file = SPIFFS.open(CONFIG_JOURNAL, "r"))) {
+      uint32_t offsets[CONFIG_JOURNAL_KEEP];
+      uint32_t end;
+      uint32_t size = file.size();
+
+      scan_config_journal(file, offsets, end);
+      file.close();
+
+      if ((end != size) || ((size + sizeof(header) + header.length) > CONFIG_JOURNAL_SIZE)) {
+        if (!compact_config_journal()) JSON_ERROR("Unable to compact config journal");
+      }
+    }
+
+    file = SPIFFS.open(CONFIG_JOURNAL, "a");
+
+    if (!file) JSON_ERROR("Unable to open config journal");
+
+    if ((file.write((uint8_t *) &header, sizeof(header)) != sizeof(header)) ||
+        (file.write((uint8_t *) scratch_text,  header.length ) != header.length )) {
+      JSON_ERROR("Unable to write config journal record");
+    }
+
+    config_bytes_written += sizeof(header) + header.length;
+
+    #if MAISON_CONFIG_CACHE
+      write_config_cache(header.crc);
+    #endif
 
     OK_DO;
   }
 
   file.close();
 
+  JSON_DEBUG(F(" Config bytes written: "));
+  JSON_DEBUGLN(config_bytes_written);
+
   JSON_SHOW_RESULT("save_config()");
 
   return result;
@@ -844,6 +2846,7 @@ bool Maison::wifi_connect()
     if (!wifi_connected()) {
       delay(200);
       WiFi.mode(WIFI_STA);
+      if (use_light_sleep()) WiFi.setSleepMode(WIFI_LIGHT_SLEEP);
       if (config.ip != 0) {
         WiFi.config(config.ip,
                     config.dns,
@@ -914,7 +2917,92 @@ bool Maison::init_callbacks()
   return result;
 }
 
-static char tmp_buff[50]; // Shared by mqtt_connect(), send_msg() and log()
+#if MAISON_SECURE
+
+// Size of the TLS receive buffer: the mqtt_tls_buffer config parameter, the
+// MAISON_TLS_BUFFER_SIZE option or, if both are 0, the smallest max fragment
+// length accepted by the broker. BearSSL then requests this max fragment
+// length when connecting. The probed size is kept in RTC memory, so that
+// Deep Sleep wakes don't probe again.
+
+uint16_t Maison::tls_buffer_size()
+{
+  if (config.mqtt_tls_buffer != 0) return config.mqtt_tls_buffer;
+  if (MAISON_TLS_BUFFER_SIZE != 0) return MAISON_TLS_BUFFER_SIZE;
+
+  if (mem.tls_buffer_size == 0) {
+    mem.tls_buffer_size = 16384; // Max fragment length not supported
+
+    for (uint16_t size = 512; size <= 4096; size <<= 1) {
+      if (BearSSL::WiFiClientSecure::probeMaxFragmentLength(config.mqtt_server,
+                                                            config.mqtt_port,
+                                                            size)) {
+        mem.tls_buffer_size = size;
+        break;
+      }
+    }
+
+    NET_DEBUG(F(" TLS receive buffer size: "));
+    NET_DEBUGLN(mem.tls_buffer_size);
+  }
+
+  return mem.tls_buffer_size;
+}
+
+#endif
+
+// The MQTT network client is constructed in place, in statically reserved
+// storage, instead of being allocated on the heap at each connection attempt.
+
+#if MAISON_SECURE
+  typedef BearSSL::WiFiClientSecure NetClient;
+#else
+  typedef WiFiClient NetClient;
+#endif
+
+alignas(NetClient) static uint8_t net_client_storage[sizeof(NetClient)];
+
+#if MAISON_SECURE
+
+  // The ESP8266 core allocates the BearSSL context and buffers at each
+  // connect() and frees them when the client is stopped: they can't be kept
+  // from one attempt to the next. While disconnected, their space is held
+  // by this block, for the allocations done meanwhile not to split it. It
+  // is released just before connecting, and the new context and buffers
+  // get the same space.
+
+  static void *   tls_reserve      = NULL;
+  static uint16_t tls_reserve_size = 0; // Receive buffer size of the last attempt
+
+  static void reserve_tls_space()
+  {
+    if ((tls_reserve == NULL) && (tls_reserve_size != 0)) {
+      tls_reserve = malloc(sizeof(br_ssl_client_context) +
+                           tls_reserve_size + MAISON_TLS_TX_BUFFER_SIZE);
+    }
+  }
+
+  static void release_tls_space()
+  {
+    free(tls_reserve);
+    tls_reserve = NULL;
+  }
+
+#endif
+
+// PubSubClient stops the network client when it finds the connection lost,
+// freeing the TLS context and buffers.
+
+bool Maison::mqtt_connected()
+{
+  if (mqtt_client.connected()) return true;
+
+  #if MAISON_SECURE
+    reserve_tls_space();
+  #endif
+
+  return false;
+}
 
 bool Maison::mqtt_connect()
 {
@@ -925,21 +3013,28 @@ bool Maison::mqtt_connect()
 
     if (!mqtt_connected()) {
 
-      if (wifi_client != NULL) {
-        delete wifi_client;
-        wifi_client = NULL;
+      // The network client is constructed only once, and stopped between
+      // attempts.
+
+      if (wifi_client == NULL) {
+        wifi_client = new (net_client_storage) NetClient;
+      }
+      else {
+        wifi_client->stop();
       }
 
       #if MAISON_SECURE
-        wifi_client = new BearSSL::WiFiClientSecure;
+        release_tls_space();
+
+        tls_reserve_size = tls_buffer_size();
+
         if (config.mqtt_fingerprint[0]) {
           wifi_client->setFingerprint(config.mqtt_fingerprint);
         }
         else {
           wifi_client->setInsecure();
         }
-      #else
-        wifi_client = new WiFiClient;
+        wifi_client->setBufferSizes(tls_reserve_size, MAISON_TLS_TX_BUFFER_SIZE);
       #endif
 
       mqtt_client.setClient(*wifi_client);
@@ -950,19 +3045,23 @@ bool Maison::mqtt_connect()
         build_topic(user_sub_topic, user_topic, sizeof(user_topic));
       }
 
-      strlcpy(tmp_buff, "client-",          sizeof(tmp_buff));
-      strlcat(tmp_buff, config.device_name, sizeof(tmp_buff));
+      strlcpy(scratch_topic, "client-",          SCRATCH_TOPIC_SIZE);
+      strlcat(scratch_topic, config.device_name, SCRATCH_TOPIC_SIZE);
 
-      NET_DEBUG(F(" Client name: ")); NET_DEBUGLN(tmp_buff            );
+      NET_DEBUG(F(" Client name: ")); NET_DEBUGLN(scratch_topic       );
       NET_DEBUG(F(" Username: "   )); NET_DEBUGLN(config.mqtt_username);
       NET_DEBUG(F(" Clean session: ")); NET_DEBUGLN(use_deep_sleep() ? F("No") : F("Yes"));
 
-      mqtt_client.connect(tmp_buff,
+      count_heap_alloc(); // The client allocates its buffers when connecting
+
+      mqtt_client.connect(scratch_topic,
                           config.mqtt_username,
                           config.mqtt_password,
                           NULL, 0, 0, NULL,    // Will message not used
                           !use_deep_sleep());  // Permanent session if deep sleep
 
+      sample_heap(); // The TLS buffers are allocated at this point
+
       if (mqtt_connected()) {
         if (!init_callbacks()) break;
       }
@@ -971,7 +3070,17 @@ bool Maison::mqtt_connect()
         NET_DEBUGLN(mqtt_client.state());
         #if MAISON_SECURE
           NET_DEBUG(F(" Last SSL Error: "));
-          NET_DEBUGLN(wifi_client->getLastSSLError());
+          int ssl_error = wifi_client->getLastSSLError();
+          NET_DEBUGLN(ssl_error);
+
+          // A handshake failure may come from a probed size the broker
+          // doesn't accept anymore: it is probed again on the next attempt.
+          // An unreachable broker keeps the probed size.
+
+          if (ssl_error != 0) mem.tls_buffer_size = 0;
+
+          wifi_client->stop();
+          reserve_tls_space();
         #endif
 
         if (++connect_retry_count >= 5) {
@@ -1001,21 +3110,21 @@ bool Maison::send_msg(const char * _topic_suffix, const __FlashStringHelper * _f
   va_list args;
   va_start (args, _format);
 
-  vsnprintf_P(buffer, MQTT_MAX_PACKET_SIZE, (const char *) _format, args);
+  vsnprintf_P(scratch_text, SCRATCH_TEXT_SIZE, (const char *) _format, args);
 
   DO {
     NET_DEBUG(F(" Sending msg to "));
-    NET_DEBUG(build_topic(_topic_suffix, tmp_buff, sizeof(tmp_buff)));
+    NET_DEBUG(build_topic(_topic_suffix, scratch_topic, SCRATCH_TOPIC_SIZE));
     NET_DEBUG(F(": "));
-    NET_DEBUGLN(buffer);
+    NET_DEBUGLN(scratch_text);
 
     if (!mqtt_connected()) {
       NET_ERROR("Unable to connect to mqtt server");
     }
     else if (!mqtt_client.publish(build_topic(_topic_suffix, 
-                                              tmp_buff, 
-                                              sizeof(tmp_buff)), 
-                                  buffer)) {
+                                              scratch_topic, 
+                                              SCRATCH_TOPIC_SIZE), 
+                                  scratch_text)) {
       NET_ERROR("Unable to publish message");
     }
 
@@ -1034,24 +3143,24 @@ bool Maison::log(const __FlashStringHelper * _format, ...)
   va_list args;
   va_start (args, _format);
 
-  strlcpy(buffer, config.device_name, 50);
-  strlcat(buffer, ": ",               50);
+  strlcpy(scratch_text, config.device_name, 50);
+  strlcat(scratch_text, ": ",               50);
 
-  int len = strlen(buffer);
+  int len = strlen(scratch_text);
 
-  vsnprintf_P(&buffer[len], MQTT_MAX_PACKET_SIZE-len, (const char *) _format, args);
+  vsnprintf_P(&scratch_text[len], SCRATCH_TEXT_SIZE - len, (const char *) _format, args);
 
   DO {
     NET_DEBUG(F(" Log msg : "));
-    NET_DEBUGLN(buffer);
+    NET_DEBUGLN(scratch_text);
 
     if (!mqtt_connected()) {
       NET_ERROR("Unable to connect to mqtt server");
     }
     else if (!mqtt_client.publish(build_topic(MAISON_LOG_TOPIC, 
-                                              tmp_buff, 
-                                              sizeof(tmp_buff)), 
-                                  buffer)) {
+                                              scratch_topic, 
+                                              SCRATCH_TOPIC_SIZE), 
+                                  scratch_text)) {
       NET_ERROR("Unable to log message");
     }
 
@@ -1063,7 +3172,7 @@ bool Maison::log(const __FlashStringHelper * _format, ...)
   return result;
 }
 
-void Maison::deep_sleep(bool _back_with_wifi, uint16_t _sleep_time_in_sec)
+void Maison::deep_sleep(bool _back_with_wifi, uint32_t _sleep_time_in_sec)
 {
   SHOW("deep_sleep()");
 
@@ -1075,18 +3184,40 @@ void Maison::deep_sleep(bool _back_with_wifi, uint16_t _sleep_time_in_sec)
 
   wifi_flush();
 
+  // Wake up for the earliest timer deadline
+
+  uint32_t next_timer = time_to_next_timer();
+  if ((next_timer / 1000U) < _sleep_time_in_sec) {
+    _sleep_time_in_sec = next_timer / 1000U;
+    DEBUG(" Sleep Duration shortened for a timer: ");
+    DEBUGLN(_sleep_time_in_sec);
+  }
+
+  // Longer periods are chained. The remaining is done by continue_deep_sleep()
+  // at the following wake ups, with the network disabled until the last one.
+
+  if (_sleep_time_in_sec > MAISON_MAX_SLEEP_PERIOD) {
+    mem.sleep_remaining = _sleep_time_in_sec - MAISON_MAX_SLEEP_PERIOD;
+    mem.sleep_network   = _back_with_wifi;
+    _sleep_time_in_sec  = MAISON_MAX_SLEEP_PERIOD;
+    _back_with_wifi     = false;
+  }
+  else {
+    mem.sleep_remaining = 0;
+  }
+
   uint32_t sleep_time = 1000000U * _sleep_time_in_sec;
 
   // When _sleep_time_in_sec is 0, will sleep only for 100ms
   if (sleep_time == 0) {
     sleep_time = 100000U;
-    mem.one_hour_step_count += millis() + 100;
+    mem.clock += millis() + 100;
   }
   else {
-    mem.one_hour_step_count += millis() + (1000U * _sleep_time_in_sec);
+    mem.clock += millis() + (1000U * _sleep_time_in_sec);
   }
 
-  mem.elapse_time = micros() - loop_time_marker + sleep_time;
+  mem.elapse_time = add_elapse_time(micros() - loop_time_marker, sleep_time);
 
   save_mems();
 
@@ -1098,24 +3229,217 @@ void Maison::deep_sleep(bool _back_with_wifi, uint16_t _sleep_time_in_sec)
   DEBUGLN(" HUM... Not suppose to come here after deep_sleep call...");
 }
 
+// Minimal wake up path of a chained Deep Sleep, called by setup() just after
+// the RTC memory is loaded: no file system, no configuration, no network.
+// Goes back to sleep for the next period if the chain is not completed.
+
+void Maison::continue_deep_sleep()
+{
+  if (is_hard_reset() || (mem.sleep_remaining == 0)) return;
+
+  uint32_t period = (mem.sleep_remaining > MAISON_MAX_SLEEP_PERIOD) ? 
+                    MAISON_MAX_SLEEP_PERIOD : mem.sleep_remaining;
+
+  mem.sleep_remaining -= period;
+
+  uint32_t sleep_time = 1000000U * period;
+  RFMode   rf_mode    = ((mem.sleep_remaining == 0) && mem.sleep_network) ? WAKE_RF_DEFAULT 
+                                                                          : WAKE_RF_DISABLED;
+
+  #if MAISON_WAKE_PIN >= 0
+    // Woken up by an event: the radio is disabled during the chain, a
+    // short sleep brings the device back with it.
+
+    pinMode(MAISON_WAKE_PIN, INPUT);
+    if (digitalRead(MAISON_WAKE_PIN) == MAISON_WAKE_LEVEL) {
+      DEBUGLN(F(" Wake up pin active, chained Deep Sleep abandoned"));
+      mem.sleep_remaining = 0;
+      period              = 0;
+      sleep_time          = 100000U;
+      rf_mode             = WAKE_RF_DEFAULT;
+    }
+  #endif
+
+  DEBUG(F(" Chained Deep Sleep: ")); DEBUG(period);
+  DEBUG(F(" seconds, remaining: ")); DEBUGLN(mem.sleep_remaining);
+
+  mem.clock      += millis() + (sleep_time / 1000U);
+  mem.elapse_time = add_elapse_time(mem.elapse_time, (uint64_t) micros() + sleep_time);
+
+  save_mems();
+
+  ESP.deepSleep(sleep_time, rf_mode);
+
+  delay(1000);
+  DEBUGLN(" HUM... Not suppose to come here after deep_sleep call...");
+}
+
 Maison::State Maison::check_if_24_hours_time(Maison::State _default_state)
 {
   DEBUG("24 hours wait time check: ");
-  DEBUG(mem.hours_24_count);
-  DEBUG(", ");
-  DEBUGLN(mem.one_hour_step_count);
+  DEBUGLN(mem.timers[WATCHDOG_TIMER] - now());
 
-  if (mem.one_hour_step_count >= (1000U * ONE_HOUR)) {
-    mem.one_hour_step_count = 0;
-    if (++mem.hours_24_count >= 24) {
-      mem.hours_24_count = 0;
-      DEBUGLN(F("HOURS_24 reached..."));
-      return HOURS_24;
-    }
+  if (timer_elapsed(WATCHDOG_TIMER)) {
+    arm_timer(WATCHDOG_TIMER, mem.timers[WATCHDOG_TIMER] + (24000U * ONE_HOUR));
+    DEBUGLN(F("HOURS_24 reached..."));
+    return HOURS_24;
   }
   return _default_state;
 }
 
+// ---- Phase Offset ----
+
+// The phase offset of the device in the day, in seconds. Unless set in the
+// config, it is a hash (FNV-1a) of the MAC address: the offsets of a set of
+// devices are spread evenly across the day, and each device keeps its own
+// from one reset to the next.
+
+uint32_t Maison::report_offset()
+{
+  if (config.report_offset != 0) return config.report_offset % (24U * ONE_HOUR);
+
+  byte     mac[6];
+  uint32_t hash = 2166136261U;
+
+  WiFi.macAddress(mac);
+  for (uint8_t i = 0; i < 6; i++) {
+    hash ^= mac[i];
+    hash *= 16777619U;
+  }
+
+  return hash % (24U * ONE_HOUR);
+}
+
+// The next HOURS_24 watchdog deadline: the next time the clock reaches the
+// phase offset of the device in its 24 hours period. As the watchdog is
+// then re-armed 24 hours after each deadline, the phase is kept.
+
+uint32_t Maison::watchdog_deadline()
+{
+  uint32_t day      = 24000U * ONE_HOUR;
+  uint32_t now_ms   = now();
+  uint32_t deadline = now_ms - (now_ms % day) + (1000U * report_offset());
+
+  if ((int32_t)(deadline - now_ms) <= 0) deadline += day;
+
+  return deadline;
+}
+
+// Delay in milliseconds before the first connection to the MQTT broker
+// after a reset.
+
+uint32_t Maison::startup_delay()
+{
+  return (1000U * report_offset()) % (1000U * MAISON_STARTUP_SPREAD);
+}
+
+bool Maison::startup_delay_pending()
+{
+  return first_connect_trial && is_hard_reset() && (millis() < startup_delay());
+}
+
+// Delay in milliseconds before a new connection attempt after a failure:
+// one hour at most, spread as the first connection. On battery power, it
+// is then a single Deep Sleep period (MAISON_MAX_SLEEP_PERIOD permitting).
+
+uint32_t Maison::retry_delay()
+{
+  uint32_t hour   = 1000U * ONE_HOUR;
+  uint32_t spread = 1000U * MAISON_STARTUP_SPREAD;
+
+  return (spread < hour) ? (hour - spread + startup_delay()) : hour;
+}
+
+uint32_t Maison::report_phase(uint32_t _period_ms)
+{
+  if (_period_ms == 0) return 0;
+
+  return (uint32_t) (((uint64_t) report_offset() * 1000U) % _period_ms);
+}
+
+// ---- Timers ----
+
+// The timer deadlines are clock values. As the clock wraps around after
+// 49 days, deadlines are compared through differences.
+
+void Maison::arm_timer(uint8_t _timer, uint32_t _deadline)
+{
+  mem.timers[_timer]  = _deadline;
+  mem.timers_armed   |=  (1 << _timer);
+  mem.timers_expired &= ~(1 << _timer);
+}
+
+bool Maison::timer_pending(uint8_t _timer)
+{
+  return (mem.timers_armed & (1 << _timer)) != 0;
+}
+
+// Returns true once when an armed timer reaches its deadline. The timer
+// is then disarmed.
+
+bool Maison::timer_elapsed(uint8_t _timer)
+{
+  if (timer_pending(_timer) && 
+      ((mem.timers_expired & (1 << _timer)) || ((int32_t)(now() - mem.timers[_timer]) >= 0))) {
+    mem.timers_armed   &= ~(1 << _timer);
+    mem.timers_expired &= ~(1 << _timer);
+    return true;
+  }
+  return false;
+}
+
+// Called at the start of loop(). The timers already expired had a chance
+// to be consumed during this loop: the ones left (e.g. a user timer only
+// checked in some states) must not shorten the waits to 0 again.
+
+void Maison::latch_expired_timers()
+{
+  for (uint8_t i = 0; i < TIMER_COUNT; i++) {
+    if (timer_pending(i) && ((int32_t)(now() - mem.timers[i]) >= 0)) {
+      mem.timers_expired |= (1 << i);
+    }
+  }
+}
+
+// Returns the number of milliseconds to wait for the earliest timer
+// deadline, 0 if a timer expired during this loop, 0xFFFFFFFF if no timer 
+// is armed. The latched timers are not waited for.
+
+uint32_t Maison::time_to_next_timer()
+{
+  uint32_t next = 0xFFFFFFFF;
+
+  for (uint8_t i = 0; i < TIMER_COUNT; i++) {
+    if (timer_pending(i) && !(mem.timers_expired & (1 << i))) {
+      int32_t remaining = mem.timers[i] - now();
+      if (remaining <= 0) return 0;
+      if ((uint32_t) remaining < next) next = remaining;
+    }
+  }
+
+  return next;
+}
+
+bool Maison::start_timer(uint8_t _timer, uint32_t _seconds)
+{
+  if (_timer >= MAISON_USER_TIMERS) return false;
+
+  arm_timer(USER_TIMERS + _timer, now() + (1000U * _seconds));
+  return true;
+}
+
+void Maison::stop_timer(uint8_t _timer)
+{
+  if (_timer < MAISON_USER_TIMERS) {
+    mem.timers_armed &= ~(1 << (USER_TIMERS + _timer));
+  }
+}
+
+bool Maison::timer_expired(uint8_t _timer)
+{
+  return (_timer < MAISON_USER_TIMERS) && timer_elapsed(USER_TIMERS + _timer);
+}
+
 // ---- RTC Memory Data Management ----
 
 #define RTC_MAGIC     0x55aaaa55
@@ -1175,9 +3499,28 @@ bool Maison::init_mem()
 
   mem.magic                    = RTC_MAGIC;
   mem.state = mem.return_state = STARTUP;
-  mem.hours_24_count           = 0;
-  mem.one_hour_step_count      = 0;
   mem.lost_count               = 0;
+  mem.tls_buffer_size          = 0;
+  mem.clock                    = 0;
+  mem.timers_armed             = 0;
+  mem.timers_expired           = 0;
+  mem.reconnect_time           = 0;
+  mem.sleep_remaining          = 0;
+  mem.sleep_network            = true;
+
+  #if MAISON_SAMPLING
+    mem.sample_period          = 0;
+    mem.report_period          = 0;
+    mem.sample_count           = 0;
+    mem.sample_sum             = 0;
+    mem.report_pending         = false;
+  #endif
+
+  #if MAISON_EVENT_CHANNELS > 0
+    for (uint8_t i = 0; i < MAISON_EVENT_CHANNELS; i++) mem.channel_states[i] = STARTUP;
+  #endif
+
+  arm_timer(WATCHDOG_TIMER, watchdog_deadline());
 
   DEBUG("Sizeof mem_struct: ");
   DEBUGLN(sizeof(mem_struct));
@@ -1252,9 +3595,50 @@ bool Maison::write_mem(uint32_t * _data, uint16_t _length, uint16_t _addr)
   return result;
 }
 
-uint32_t Maison::CRC32(const uint8_t * _data, size_t _length)
+#if MAISON_CONFIG_CACHE
+
+  // The magic number is related to the Config structure size, such that a cache 
+  // saved by a code with a different layout is not used after an OTA update.
+
+  #define CONFIG_CACHE_MAGIC (0x5a5a0000 + sizeof(Config))
+
+  // Retrieve the config from RTC memory. If _file_crc is not 0, the cache must
+  // have been built from a config file with the same checksum.
+
+  bool Maison::read_config_cache(uint32_t _file_crc)
+  {
+    if (!config_cache_enabled()) return false;
+
+    config_cache_struct cache;
+
+    if (!read_mem((uint32_t *) &cache, sizeof(cache), config_cache_addr()) ||
+        (cache.magic != CONFIG_CACHE_MAGIC) ||
+        ((_file_crc != 0) && (cache.file_crc != _file_crc))) {
+      return false;
+    }
+
+    config = cache.config;
+    return true;
+  }
+
+  bool Maison::write_config_cache(uint32_t _file_crc)
+  {
+    if (!config_cache_enabled()) return false;
+
+    config_cache_struct cache;
+
+    cache.magic    = CONFIG_CACHE_MAGIC;
+    cache.file_crc = _file_crc;
+    cache.config   = config;
+
+    return write_mem((uint32_t *) &cache, sizeof(cache), config_cache_addr());
+  }
+
+#endif
+
+uint32_t Maison::CRC32(const uint8_t * _data, size_t _length, uint32_t _crc)
 {
-  uint32_t crc = 0xffffffff;
+  uint32_t crc = _crc;
 
   DEBUG(F("Computing CRC: data addr: "));
   DEBUG((int)_data);
@@ -1396,15 +3780,17 @@ bool Maison::str2ip(const char * _str, uint32_t * _ip)
     JSON_DEBUG(F("WiFi SSID     : ")); JSON_DEBUGLN(_config.wifi_ssid       );
     JSON_DEBUG(F("WiFi Password : ")); JSON_DEBUGLN(F("<Hidden>")           );
 
-    JSON_DEBUG(F("IP            : ")); JSON_DEBUGLN(ip2str(config.ip,          buffer, 50));
-    JSON_DEBUG(F("DNS           : ")); JSON_DEBUGLN(ip2str(config.dns,         buffer, 50));
-    JSON_DEBUG(F("Gateway       : ")); JSON_DEBUGLN(ip2str(config.gateway,     buffer, 50));
-    JSON_DEBUG(F("Subnet Mask   : ")); JSON_DEBUGLN(ip2str(config.subnet_mask, buffer, 50));
+    JSON_DEBUG(F("IP            : ")); JSON_DEBUGLN(ip2str(config.ip,          scratch_text, 50));
+    JSON_DEBUG(F("DNS           : ")); JSON_DEBUGLN(ip2str(config.dns,         scratch_text, 50));
+    JSON_DEBUG(F("Gateway       : ")); JSON_DEBUGLN(ip2str(config.gateway,     scratch_text, 50));
+    JSON_DEBUG(F("Subnet Mask   : ")); JSON_DEBUGLN(ip2str(config.subnet_mask, scratch_text, 50));
 
     JSON_DEBUG(F("MQTT Server   : ")); JSON_DEBUGLN(_config.mqtt_server     );
     JSON_DEBUG(F("MQTT Username : ")); JSON_DEBUGLN(_config.mqtt_username   );
     JSON_DEBUG(F("MQTT Password : ")); JSON_DEBUGLN(F("<Hidden>")           );
     JSON_DEBUG(F("MQTT Port     : ")); JSON_DEBUGLN(_config.mqtt_port       );
+    JSON_DEBUG(F("MQTT TLS Buf. : ")); JSON_DEBUGLN(_config.mqtt_tls_buffer );
+    JSON_DEBUG(F("Report Offset : ")); JSON_DEBUGLN(_config.report_offset   );
 
     JSON_DEBUG(F("MQTT Fingerprint : ["));
     for (int i = 0; i < 20; i++) {
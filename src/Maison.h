@@ -9,6 +9,7 @@
 #include <ArduinoJson.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <new>
 
 #ifndef APP_NAME
   #define APP_NAME "UNKNOWN"
@@ -22,6 +23,27 @@
   #define MQTT_OTA 0
 #endif
 
+// Size of the block used to stage the received code before writing it to
+// flash. Must be a multiple of the flash sector size.
+
+#ifndef OTA_BLOCK_SIZE
+  #define OTA_BLOCK_SIZE FLASH_SECTOR_SIZE
+#endif
+
+// Largest heatshrink window (log2 of its size in bytes) accepted for
+// compressed code updates. The window is allocated during the upload only.
+
+#ifndef OTA_MAX_WINDOW_BITS
+  #define OTA_MAX_WINDOW_BITS 12
+#endif
+
+// Number of times a shared image chunk received with a bad CRC is
+// requested again before the code update is aborted.
+
+#ifndef OTA_CHUNK_RETRIES
+  #define OTA_CHUNK_RETRIES 3
+#endif
+
 // Insure that MQTT Packet size is big enough for the needs of the framework
 // This is an option of the PubSubClient library that can be set through platformio.ini
 
@@ -137,6 +159,21 @@
   #define MAISON_CTRL_TOPIC "ctrl" ///< Suffix for device control topic
 #endif
 
+// This is the topic name part where shared code images are retained for
+// fleet-wide OTA updates. The chunks of an image are found under:
+//
+// 1) MAISON_PREFIX_TOPIC
+// 2) MAISON_OTA_TOPIC
+// 3) The application name
+// 4) The image ID
+// 5) The chunk index (0 to CHUNKS - 1)
+//
+// For example: maison/ota/BLINKER/v12/0
+
+#ifndef MAISON_OTA_TOPIC
+  #define MAISON_OTA_TOPIC "ota" ///< Topic part for shared OTA images
+#endif
+
 #ifndef DEFAULT_SHORT_REBOOT_TIME
   #define DEFAULT_SHORT_REBOOT_TIME 5  ///< DeepSleep time in seconds for short time states
 #endif
@@ -145,6 +182,201 @@
   # define MAISON_SECURE 1
 #endif
 
+// Size in bytes of the TLS receive buffer. If 0, the smallest max fragment
+// length (512 to 4096) accepted by the MQTT broker is used, as found by
+// probing it. The mqtt_tls_buffer config parameter, if not 0, has precedence.
+
+#ifndef MAISON_TLS_BUFFER_SIZE
+  #define MAISON_TLS_BUFFER_SIZE 0
+#endif
+
+// Size in bytes of the TLS send buffer.
+
+#ifndef MAISON_TLS_TX_BUFFER_SIZE
+  #define MAISON_TLS_TX_BUFFER_SIZE 512
+#endif
+
+// The configuration changes are appended to a journal file. When the journal
+// would grow beyond CONFIG_JOURNAL_SIZE bytes, it is compacted to keep the
+// last CONFIG_JOURNAL_KEEP configurations (the new one included).
+
+#ifndef CONFIG_JOURNAL_SIZE
+  #define CONFIG_JOURNAL_SIZE 4096
+#endif
+
+#ifndef CONFIG_JOURNAL_KEEP
+  #define CONFIG_JOURNAL_KEEP 5
+#endif
+
+// Capacity in bytes of the JSON document shared by the framework to parse and
+// build the config and the control messages. It is statically allocated.
+// A complete config read from a file stream (keys and values copied in the
+// document, 16 bytes per member or array element) takes around 950 bytes,
+// its 20 elements fingerprint array included: 2048 leaves room for it.
+
+#ifndef MAISON_JSON_DOC_SIZE
+  #define MAISON_JSON_DOC_SIZE 2048
+#endif
+
+// Size in bytes of the scratch arena shared by the framework to format the
+// messages sent to the broker, build the topic names and read or write the
+// config file. It must hold the config file content (without the last 80
+// bytes, reserved for the topic names). It replaces the buffers that were
+// part of the Maison object.
+
+#ifndef MAISON_SCRATCH_SIZE
+  #define MAISON_SCRATCH_SIZE MQTT_MAX_PACKET_SIZE
+#endif
+
+// If MAISON_MEMORY_REPORT is != 0, the static RAM used by the framework
+// buffers is listed at compile time. If MAISON_RAM_BUDGET is defined,
+// compilation fails when the framework static RAM exceeds it.
+
+#ifndef MAISON_MEMORY_REPORT
+  #define MAISON_MEMORY_REPORT 0
+#endif
+
+// If MAISON_REDACT_CONFIG is != 0, the wifi and mqtt passwords are replaced
+// with "****" in the config messages sent by the device.
+
+#ifndef MAISON_REDACT_CONFIG
+  #define MAISON_REDACT_CONFIG 0
+#endif
+
+// If MAISON_CONFIG_CACHE is != 0, a binary copy of the configuration is kept
+// in RTC memory, after the user application state. It is used on Deep Sleep
+// returns instead of reading the config file. It is disabled if there is not
+// enough room left in RTC memory.
+
+#ifndef MAISON_CONFIG_CACHE
+  #define MAISON_CONFIG_CACHE 1
+#endif
+
+// Number of application timers kept in RTC memory (see Maison::start_timer()).
+
+#ifndef MAISON_USER_TIMERS
+  #define MAISON_USER_TIMERS 4
+#endif
+
+// Number of event channels, in addition to the main finite state machine.
+// Each channel has its own state, kept in RTC memory, and its own process
+// function (see Maison::set_channel_process()).
+
+#ifndef MAISON_EVENT_CHANNELS
+  #define MAISON_EVENT_CHANNELS 0
+#endif
+
+// Number of inputs that can be captured through GPIO interrupts (see
+// Maison::add_input()), up to 4. 0 to disable input capture.
+
+#ifndef MAISON_INPUTS
+  #define MAISON_INPUTS 0
+#endif
+
+// Size of the input edges and events ring buffers. Must be a power of 2.
+
+#ifndef MAISON_INPUT_BUFFER_SIZE
+  #define MAISON_INPUT_BUFFER_SIZE 16
+#endif
+
+// Time in milliseconds an input must be stable before its change is
+// reported as an event.
+
+#ifndef MAISON_INPUT_DEBOUNCE
+  #define MAISON_INPUT_DEBOUNCE 50
+#endif
+
+// If MAISON_SAMPLING is != 0, the samples of a value provided by the
+// application are aggregated in RTC memory (count, min, max and mean) and a
+// summary is published once per reporting interval. The last
+// MAISON_SAMPLE_SERIES samples are also kept (2 bytes of RTC memory each)
+// and published as a delta encoded series.
+
+#ifndef MAISON_SAMPLING
+  #define MAISON_SAMPLING 0
+#endif
+
+#ifndef MAISON_SAMPLE_SERIES
+  #define MAISON_SAMPLE_SERIES 0
+#endif
+
+// With the LIGHT_SLEEP feature, period in milliseconds at which received
+// data and input changes are checked while Maison::loop() waits.
+
+#ifndef MAISON_LIGHT_SLEEP_POLL
+  #define MAISON_LIGHT_SLEEP_POLL 100
+#endif
+
+// With the DEEP_SLEEP feature, if MAISON_HYBRID_SLEEP is != 0, short waits
+// are done awake, keeping the MQTT connection open, instead of in Deep Sleep.
+// A wait is short when it lasts less than the measured reconnection time
+// multiplied by MAISON_RECONNECT_COST_RATIO, the ratio of the current drawn
+// while connecting to the current drawn while waiting awake (modem sleep).
+// Disabled by default: the ratio must be measured on the target hardware.
+
+#ifndef MAISON_HYBRID_SLEEP
+  #define MAISON_HYBRID_SLEEP 0
+#endif
+
+#ifndef MAISON_RECONNECT_COST_RATIO
+  #define MAISON_RECONNECT_COST_RATIO 4
+#endif
+
+// Longest single Deep Sleep period, in seconds. The ESP8266 cannot sleep
+// more than 4294 seconds at once: longer periods are chained, the
+// intermediate wake ups going straight back to sleep with the radio
+// disabled (see Maison::setup()).
+
+#ifndef MAISON_MAX_SLEEP_PERIOD
+  #define MAISON_MAX_SLEEP_PERIOD 3600
+#endif
+
+// A wake up through the RST pin (e.g. by an event) during a chained Deep
+// Sleep can't be told apart from an intermediate wake up of the chain. If
+// MAISON_WAKE_PIN is a GPIO number, it is read at the intermediate wake ups:
+// when it is at the MAISON_WAKE_LEVEL level, the chain is abandoned and the
+// device comes back at once with the radio enabled. If it is -1, such wake
+// ups are ignored until the end of the chain.
+
+#ifndef MAISON_WAKE_PIN
+  #define MAISON_WAKE_PIN -1
+#endif
+
+#ifndef MAISON_WAKE_LEVEL
+  #define MAISON_WAKE_LEVEL LOW
+#endif
+
+// Each device gets a phase offset in the day, derived from its MAC address
+// or set with the report_offset config parameter. After a reset, the first
+// connection to the MQTT broker is delayed by up to MAISON_STARTUP_SPREAD
+// seconds according to this offset, so that devices rebooting together don't
+// all connect in the same second. The retries after a failure are spread the
+// same way within the hour.
+
+#ifndef MAISON_STARTUP_SPREAD
+  #define MAISON_STARTUP_SPREAD 30
+#endif
+
+// Maximum number of tasks that can be registered with Maison::add_task().
+
+#ifndef MAISON_MAX_TASKS
+  #define MAISON_MAX_TASKS 4
+#endif
+
+// When tasks are registered, Maison::loop() waits for the next task deadline,
+// but no more than MAISON_TASK_MAX_IDLE milliseconds, to keep servicing the
+// MQTT connection.
+
+#ifndef MAISON_TASK_MAX_IDLE
+  #define MAISON_TASK_MAX_IDLE 100
+#endif
+
+// Sizes in bytes of the topic names kept by the framework: the ctrl and user
+// topics, and the shared OTA image chunks topic.
+
+#define MAISON_TOPIC_SIZE     60
+#define MAISON_OTA_TOPIC_SIZE 80
+
 #if MAISON_SECURE
   #include <WiFiClientSecure.h>
 #else
@@ -299,7 +531,8 @@ class Maison
       NONE          = 0x00, ///< No special feature
       VOLTAGE_CHECK = 0x01, ///< Chip A2D voltage readout will be sent on status/watchdog messages
       DEEP_SLEEP    = 0x02, ///< Using batteries -> deep_sleep will be used then
-      WATCHDOG_24H  = 0x04  ///< Watchdog status sent every 24 hours
+      WATCHDOG_24H  = 0x04, ///< Watchdog status sent every 24 hours
+      LIGHT_SLEEP   = 0x08  ///< Without DEEP_SLEEP, WiFi light sleep between loop() calls
     };
 
     /// States of the finite state machine
@@ -369,6 +602,31 @@ class Maison
 
     typedef void Callback(const char * _topic, byte * _payload, unsigned int _length);
 
+    /// Application defined task function. To be registered with Maison::add_task().
+
+    typedef void Task();
+
+    /// Application defined sampler function. To be registered with
+    /// Maison::set_sampling_interval(). Returns false if no sample is available.
+
+    typedef bool Sampler(int16_t & _value);
+
+    /// An input change, as returned by Maison::get_input_event().
+
+    struct InputEvent {
+      uint8_t  input;  ///< The input number, as returned by Maison::add_input()
+      bool     active; ///< True if the input became active
+      uint32_t time;   ///< The millis() value of the change
+    };
+
+    /// Run-time statistics of a task, as returned by Maison::get_task_stats().
+
+    struct TaskStats {
+      uint32_t run_count;  ///< Number of times the task has been run
+      uint32_t total_time; ///< Total run time in microseconds
+      uint32_t max_time;   ///< Longest run time in microseconds
+    };
+
     Maison();
     Maison(uint8_t _feature_mask);
     Maison(uint8_t _feature_mask, void * _user_mem, uint16_t _user_mem_length);
@@ -421,9 +679,10 @@ class Maison
     /// Initiates an `ESP.deep_sleep()` call. This function never suppose to return...
     ///
     /// @param[in] _back_with_wifi True if WiFi networking enabled on restart
-    /// @param[in] _sleep_time_in_sec The number of second to wait before restart
+    /// @param[in] _sleep_time_in_sec The number of second to wait before restart. Periods
+    ///            longer than MAISON_MAX_SLEEP_PERIOD are chained.
 
-    void deep_sleep(bool _back_with_wifi, uint16_t _sleep_time_in_sec);
+    void deep_sleep(bool _back_with_wifi, uint32_t _sleep_time_in_sec);
 
     /// Enable a feature dynamically.
     ///
@@ -458,12 +717,47 @@ class Maison
       return reset_reason() != REASON_DEEP_SLEEP_AWAKE;
     }
 
-    /// Set the deep_sleep period inside an application process function.
+    /// Start an application timer. Its deadline is kept in RTC memory, and the
+    /// Deep Sleep periods are shortened for the device to wake up on time.
+    ///
+    /// @param[in] _timer The timer number, from 0 to MAISON_USER_TIMERS - 1.
+    /// @param[in] _seconds The number of seconds before the timer expires.
+    /// @return True if the timer was started.
+
+    bool start_timer(uint8_t _timer, uint32_t _seconds);
+
+    /// Stop an application timer.
+    ///
+    /// @param[in] _timer The timer number, from 0 to MAISON_USER_TIMERS - 1.
+
+    void stop_timer(uint8_t _timer);
+
+    /// Check if an application timer expired. The timer is stopped when its
+    /// expiration is reported.
+    ///
+    /// @param[in] _timer The timer number, from 0 to MAISON_USER_TIMERS - 1.
+    /// @return True if the timer expired since the last call.
+
+    bool timer_expired(uint8_t _timer);
+
+    /// Returns the phase of this device for a periodic report, derived from the
+    /// phase offset used for the *HOURS_24* watchdog. To be used as the first
+    /// delay of a periodic task, so that devices with the same period don't
+    /// report at the same time.
+    ///
+    /// @param[in] _period_ms The report period in milliseconds.
+    /// @return The phase in milliseconds, from 0 to _period_ms - 1.
+
+    uint32_t report_phase(uint32_t _period_ms);
+
+    /// Set the deep_sleep period inside an application process function. There
+    /// is no limit: periods longer than MAISON_MAX_SLEEP_PERIOD are chained, and
+    /// the device wakes up earlier for a timer deadline.
     ///
     /// @param[in] _seconds The number of seconds to wait inside the next Deep Sleep call.
 
-    inline void set_deep_sleep_wait_time(uint16_t _seconds) {
-      deep_sleep_wait_time = (_seconds > 4294) ? 4294 : _seconds;
+    inline void set_deep_sleep_wait_time(uint32_t _seconds) {
+      deep_sleep_wait_time = _seconds;
     }
 
     /// Checks if networking is currently available. Always true if *DEEP_SLEEP*
@@ -472,12 +766,41 @@ class Maison
     /// @return True if the network is enabled.
 
     inline bool network_is_available() {
+      #if MAISON_SAMPLING
+        if (mem.report_pending) return true;
+      #endif
       return (!use_deep_sleep()) ||
-             ((mem.state & (STARTUP|PROCESS_EVENT|END_EVENT|HOURS_24)) != 0);
+             ((all_states() & (STARTUP|PROCESS_EVENT|END_EVENT|HOURS_24)) != 0);
     }
 
+    #if MAISON_EVENT_CHANNELS > 0
+
+      /// Set the process function of an event channel. An event channel is a
+      /// finite state machine independent of the main one, with the same states
+      /// (except *HOURS_24*) and transitions. Its process function is called by
+      /// Maison::loop() after the main process function. The network is
+      /// available when one of the state machines needs it, and the Deep Sleep
+      /// period is the shortest requested by them.
+      ///
+      /// @param[in] _channel The channel number, from 0 to MAISON_EVENT_CHANNELS - 1.
+      /// @param[in] _process The channel process function.
+      /// @return True if the channel number is valid.
+
+      bool set_channel_process(uint8_t _channel, Process * _process);
+
+      /// Get the current state of an event channel.
+      ///
+      /// @param[in] _channel The channel number, from 0 to MAISON_EVENT_CHANNELS - 1.
+      /// @return The channel state, STARTUP if the channel number is not valid.
+
+      inline State get_channel_state(uint8_t _channel) {
+        return (_channel < MAISON_EVENT_CHANNELS) ? mem.channel_states[_channel] : STARTUP;
+      }
+
+    #endif
+
     /// Get elapsed time since the last call to user process in the preceding loop call.
-    /// @return Elapsed time in microseconds.
+    /// @return Elapsed time in microseconds, saturated at 0x7FFFFFFF (about 35 minutes).
 
     inline long last_loop_duration() {
       return mem.elapse_time;
@@ -504,9 +827,10 @@ class Maison
     ///
     /// @param[in] _data The data vector to compute the checksum on.
     /// @param[in] _length The size of the data vector.
+    /// @param[in] _crc The checksum of the preceding data, to compute it in pieces.
     /// @return The computed CRC-32 checksum.
 
-    uint32_t CRC32(const uint8_t * _data, size_t _length);
+    uint32_t CRC32(const uint8_t * _data, size_t _length, uint32_t _crc = 0xffffffff);
 
     /// Set the MQTT message callback for the user application.
     ///
@@ -516,6 +840,91 @@ class Maison
 
     void set_msg_callback(Callback * _cb, const char * _sub_topic, uint8_t _qos = 0);
 
+    /// Register a task to be run by Maison::loop(), between the servicing of the
+    /// network and the call to the user process function. Tasks are run in turn
+    /// and must return quickly: they replace waiting loops and calls to delay().
+    ///
+    /// @param[in] _task The task function.
+    /// @param[in] _period_ms The task period in milliseconds. 0 for a one-shot task,
+    ///                       removed once run.
+    /// @param[in] _delay_ms The time to wait before the first run, in milliseconds.
+    /// @return The task identifier, or -1 if MAISON_MAX_TASKS tasks are already registered.
+
+    int8_t add_task(Task * _task, uint32_t _period_ms, uint32_t _delay_ms = 0);
+
+    /// Remove a registered task.
+    ///
+    /// @param[in] _task_id The task identifier, as returned by Maison::add_task().
+
+    void remove_task(int8_t _task_id);
+
+    #if MAISON_INPUTS > 0
+
+      /// Capture the changes of a GPIO input. The changes are timestamped by an
+      /// interrupt handler and debounced by Maison::loop(), that queues them as
+      /// input events. If _new_event is true, a pending event of this input makes
+      /// the finite state machine go from *WAIT_FOR_EVENT* to *PROCESS_EVENT*, as if
+      /// the process function returned *NEW_EVENT*.
+      ///
+      /// @param[in] _pin The GPIO pin number. Its mode must be set by the application.
+      /// @param[in] _active_low True if the input is active when at the LOW level.
+      /// @param[in] _new_event True if the input events are *NEW_EVENT*s.
+      /// @return The input number, or -1 if MAISON_INPUTS inputs are already captured.
+
+      int8_t add_input(uint8_t _pin, bool _active_low = true, bool _new_event = true);
+
+      /// Get the oldest pending input event.
+      ///
+      /// @param[out] _event The input event.
+      /// @return True if an event was pending.
+
+      bool get_input_event(InputEvent & _event);
+
+      /// Get the debounced state of an input.
+      ///
+      /// @param[in] _input The input number, as returned by Maison::add_input().
+      /// @return True if the input is active.
+
+      bool input_is_active(uint8_t _input);
+
+    #endif
+
+    #if MAISON_SAMPLING
+
+      /// Set the sampler function and the sampling interval. The sampler is
+      /// called by Maison::loop() once per interval, and its samples are
+      /// aggregated in RTC memory. To be called after Maison::setup(). The
+      /// interval is restarted only if it changed.
+      ///
+      /// @param[in] _sampler The sampler function.
+      /// @param[in] _seconds The sampling interval in seconds. 0 to stop sampling.
+
+      void set_sampling_interval(Sampler * _sampler, uint32_t _seconds);
+
+      /// Set the reporting interval. A summary of the samples is published
+      /// once per interval. To be called after Maison::setup(). The interval
+      /// is restarted only if it changed.
+      ///
+      /// @param[in] _seconds The reporting interval in seconds. 0 to stop reporting.
+
+      void set_reporting_interval(uint32_t _seconds);
+
+      /// Add a sample to the current reporting window, outside of the sampler.
+      ///
+      /// @param[in] _value The sample.
+
+      void add_sample(int16_t _value);
+
+    #endif
+
+    /// Get the run-time statistics of a registered task.
+    ///
+    /// @param[in]  _task_id The task identifier, as returned by Maison::add_task().
+    /// @param[out] _stats The task statistics.
+    /// @return True if the task is registered.
+
+    bool get_task_stats(int8_t _task_id, TaskStats & _stats);
+
     /// Get device name. The device name is retrieve from the configuration and
     /// sent back to the user as a constant string.
     ///
@@ -551,19 +960,112 @@ class Maison
       char       mqtt_username[16];
       char       mqtt_password[32];
       uint8_t mqtt_fingerprint[20];
+      uint16_t     mqtt_tls_buffer; // TLS receive buffer size, 0 for the default
+      uint32_t       report_offset; // Phase offset in the day (seconds), 0 if from the MAC address (86400 for 0)
     } config;
 
+    // Impact of a config change, from the cheapest to the most expensive
+    // action required to apply it
+
+    enum ConfigImpact : uint8_t {
+      CONFIG_UNCHANGED, ///< Only the version number changed
+      CONFIG_IN_PLACE,  ///< Applied by updating the config in memory (device_name)
+      CONFIG_MQTT,      ///< Requires a reconnection to the MQTT broker
+      CONFIG_WIFI       ///< Requires a reconnection to the WiFi network
+    };
+
+    // The timers kept in RTC memory: the framework ones, followed by the
+    // MAISON_USER_TIMERS application timers
+
+    enum Timer : uint8_t {
+      WATCHDOG_TIMER,               // Next HOURS_24 state
+      RETRY_TIMER,                  // Next MQTT connection retry on battery power
+      #if MAISON_SAMPLING
+        SAMPLE_TIMER,               // Next sample
+        REPORT_TIMER,               // Next samples summary
+      #endif
+      USER_TIMERS
+    };
+
+    static const uint8_t TIMER_COUNT = USER_TIMERS + MAISON_USER_TIMERS;
+
     struct mem_struct {
       uint32_t csum;
       State    state;
       State    return_state;
-      uint16_t hours_24_count;      // Up to 24 hours
       uint16_t lost_count;          // How many MQTT lost connections since reset
-      uint32_t one_hour_step_count; // Up to 3600 seconds in milliseconds
+      uint16_t tls_buffer_size;     // TLS receive buffer size found by probing, 0 if not probed
+      uint16_t timers_armed;        // One bit per armed timer
+      uint16_t timers_expired;      // One bit per armed timer found expired and not consumed yet
+      uint16_t reconnect_time;      // Average time in ms from a Deep Sleep wake up to MQTT connected
+      uint32_t clock;               // Milliseconds since reset, Deep Sleep time included
+      uint32_t timers[TIMER_COUNT]; // Timer deadlines, as clock values
+      #if MAISON_EVENT_CHANNELS > 0
+        State  channel_states[MAISON_EVENT_CHANNELS];
+      #endif
+      #if MAISON_SAMPLING
+        uint32_t sample_period;     // Sampling interval in seconds, 0 if not sampling
+        uint32_t report_period;     // Reporting interval in seconds, 0 if not reporting
+        int32_t  sample_sum;        // Current reporting window aggregates
+        uint16_t sample_count;
+        int16_t  sample_min;
+        int16_t  sample_max;
+        bool     report_pending;    // A summary is waiting for the network
+        #if MAISON_SAMPLE_SERIES > 0
+          int16_t series[MAISON_SAMPLE_SERIES]; // Last samples, a ring indexed by sample_count
+        #endif
+      #endif
+      uint32_t sleep_remaining;     // Seconds of a chained Deep Sleep still to go
+      bool     sleep_network;       // Network enabled at the end of the chained Deep Sleep
       uint32_t elapse_time;
       uint32_t magic;
     } mem;
 
+    static_assert(TIMER_COUNT <= 16, "MAISON_USER_TIMERS is too large");
+    static_assert(MAISON_SAMPLE_SERIES <= 64, "MAISON_SAMPLE_SERIES must be at most 64");
+    static_assert(sizeof(mem_struct) <= 512, "The Maison state doesn't fit in RTC memory");
+    static_assert((MAISON_MAX_SLEEP_PERIOD > 0) && (MAISON_MAX_SLEEP_PERIOD <= 4294), 
+                  "MAISON_MAX_SLEEP_PERIOD must be between 1 and 4294");
+    static_assert((MAISON_STARTUP_SPREAD > 0) && (MAISON_STARTUP_SPREAD < 3600), 
+                  "MAISON_STARTUP_SPREAD must be between 1 and 3599");
+
+    inline uint32_t now() { return mem.clock + (millis() - last_time_count); }
+
+    void     arm_timer(uint8_t _timer, uint32_t _deadline);
+    bool timer_elapsed(uint8_t _timer);
+    bool timer_pending(uint8_t _timer);
+    uint32_t time_to_next_timer();
+    void latch_expired_timers();
+
+    void continue_deep_sleep();
+
+    uint32_t     report_offset();
+    uint32_t watchdog_deadline();
+    uint32_t     startup_delay();
+    bool startup_delay_pending();
+    uint32_t       retry_delay();
+
+    // Each record of the config journal is this header followed by the
+    // config file content (JSON)
+
+    struct config_record_header {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t length;              // Config content length
+      uint32_t crc;                 // CRC-32 of the config content
+    };
+
+    uint32_t config_bytes_written;  // Flash bytes written by the last save_config()
+
+    #if MAISON_CONFIG_CACHE
+      struct config_cache_struct {
+        uint32_t csum;
+        uint32_t magic;
+        uint32_t file_crc;          // CRC-32 of the config file content. 0 if unknown
+        Config   config;
+      };
+    #endif
+
     PubSubClient                mqtt_client;
     #if MAISON_SECURE
       BearSSL::WiFiClientSecure * wifi_client;
@@ -574,6 +1076,7 @@ class Maison
     long         last_reconnect_attempt;
     int          connect_retry_count;
     bool         first_connect_trial;
+    bool         stayed_awake;        // The last wait was done awake instead of in Deep Sleep
     Callback   * user_callback;
     const char * user_sub_topic;
     uint8_t      user_qos;
@@ -582,16 +1085,73 @@ class Maison
     uint16_t     user_mem_length;
     long         last_time_count;
     bool         counting_lost_connection;
-    uint16_t     deep_sleep_wait_time;
+    uint32_t     deep_sleep_wait_time;
     uint32_t     loop_time_marker;
     bool         some_message_received;
     bool         wait_for_ota_completion;
     bool         reboot_now;  // reboot after code update
+    ConfigImpact reconnect_needed; // reconnect after a config change
     bool         restart_now; // restart after saving the state
 
-    char         buffer[MQTT_MAX_PACKET_SIZE];
-    char         topic[60];
-    char         user_topic[60];
+    struct task_struct {
+      Task     * task;            // NULL if the entry is free
+      uint32_t   period;          // 0 for a one-shot task
+      uint32_t   next_run;        // millis() value of the next run
+      TaskStats  stats;
+    } tasks[MAISON_MAX_TASKS];
+
+    #if MAISON_HYBRID_SLEEP
+      bool stay_awake(uint32_t _wait_time);
+      void awake_wait(uint32_t _wait_time);
+    #endif
+
+    void       run_tasks();
+    void idle_until_next_task();
+    bool  wake_up_needed();
+
+    #if MAISON_INPUTS > 0
+      struct input_struct {
+        uint8_t  pin;
+        bool     active_low;
+        bool     new_event;
+        uint8_t  stable_level;      // Debounced level
+        uint8_t  last_level;        // Level after the last edge
+        uint32_t last_edge;         // millis() value of the last edge
+      } inputs[MAISON_INPUTS];
+
+      uint8_t    input_count;
+      InputEvent input_events[MAISON_INPUT_BUFFER_SIZE];
+      uint8_t    input_event_head;
+      uint8_t    input_event_tail;
+
+      void process_inputs();
+      bool new_input_event_pending();
+      uint32_t time_to_debounce();
+    #endif
+
+    #if MAISON_SAMPLING
+      Sampler * sampler;
+
+      void  process_samples();
+      void send_samples_msg();
+      void      rearm_timer(uint8_t _timer, uint32_t _period_ms);
+    #endif
+
+    char         topic[MAISON_TOPIC_SIZE];
+    char         user_topic[MAISON_TOPIC_SIZE];
+
+    #if MQTT_OTA
+      char         ota_topic[MAISON_OTA_TOPIC_SIZE]; // Shared image chunks topic, without the chunk index
+      uint16_t     ota_chunk_count;   // Shared image chunks count (0 if streamed on ctrl)
+      uint16_t     ota_chunk_size;
+      uint16_t     ota_next_chunk;
+      uint8_t      ota_chunk_retries;
+
+      bool    subscribe_ota_chunk(bool _subscribe, uint16_t _index);
+      bool   subscribe_ota_window(bool _subscribe);
+      void      process_ota_chunk(const char * _topic, byte * _payload, unsigned int _length);
+      void           complete_ota();
+    #endif
 
     bool wifi_connect();
     bool mqtt_connect();
@@ -602,18 +1162,36 @@ class Maison
     void       process_callback(const char * _topic, byte * _payload, unsigned int _length);
 
     inline bool   wifi_connected() { return WiFi.status() == WL_CONNECTED;             }
-    inline bool   mqtt_connected() { return mqtt_client.connected();                   }
+    bool          mqtt_connected();
 
     inline void        mqtt_loop() { mqtt_client.loop();                               }
 
     inline bool     show_voltage() { return (feature_mask & VOLTAGE_CHECK) != 0;       }
     inline bool   use_deep_sleep() { return (feature_mask & DEEP_SLEEP)    != 0;       }
     inline bool watchdog_enabled() { return (feature_mask & WATCHDOG_24H ) != 0;       }
+    inline bool  use_light_sleep() { return (feature_mask & (LIGHT_SLEEP|DEEP_SLEEP)) == LIGHT_SLEEP; }
 
-    inline bool is_short_reboot_time_needed() {
-      return (mem.state & (PROCESS_EVENT|WAIT_END_EVENT|END_EVENT|HOURS_24)) != 0;
+    inline bool is_short_reboot_time_needed(State _state) {
+      return (_state & (PROCESS_EVENT|WAIT_END_EVENT|END_EVENT|HOURS_24)) != 0;
     }
 
+    // The states of the main finite state machine and of the event channels, or'ed
+
+    inline uint8_t all_states() {
+      uint8_t states = mem.state;
+      #if MAISON_EVENT_CHANNELS > 0
+        for (uint8_t i = 0; i < MAISON_EVENT_CHANNELS; i++) states |= mem.channel_states[i];
+      #endif
+      return states;
+    }
+
+    #if MAISON_EVENT_CHANNELS > 0
+      Process * channel_process[MAISON_EVENT_CHANNELS];
+
+      void    run_channels();
+      State channel_transition(State _state, UserResult _res);
+    #endif
+
     inline UserResult call_user_process(Process * _process) {
       if (_process == NULL) {
         return COMPLETED;
@@ -626,14 +1204,26 @@ class Maison
 
     State check_if_24_hours_time(State _default_state);
     bool retrieve_config(JsonObject _doc, Config & _config);
-    bool load_config(int _version = 0);
+    bool    patch_config(JsonObject _patch, Config & _config);
+    bool load_config(int _index = 0);
+    bool open_config(File & _file, int _index, config_record_header & _header);
+    int  scan_config_journal(File & _file, uint32_t * _offsets, uint32_t & _end);
+    bool compact_config_journal();
 
     bool init_callbacks();
 
     bool     save_config();
+    #if MAISON_SECURE
+      uint16_t tls_buffer_size();
+    #endif
     void send_config_msg();
     void  send_state_msg(const char * _msg_type);
-    void  get_new_config();
+    void   send_heap_msg();
+    void  get_new_config(char * _json, size_t _length);
+    void get_config_patch(char * _json, size_t _length);
+    void    apply_config(Config & _config);
+    ConfigImpact config_impact(Config & _config);
+    void   reconnect();
 
     #if JSON_TESTING
       void show_config(Config & _config);
@@ -649,6 +1239,15 @@ class Maison
     bool      read_mem(uint32_t * _data, uint16_t _length, uint16_t _addr);
     bool     write_mem(uint32_t * _data, uint16_t _length, uint16_t _addr);
 
+    #if MAISON_CONFIG_CACHE
+      inline uint16_t config_cache_addr() { return sizeof(mem) + ((user_mem_length + 3) & ~3); }
+      inline bool config_cache_enabled() {
+        return (config_cache_addr() + sizeof(config_cache_struct)) <= 512;
+      }
+      bool  read_config_cache(uint32_t _file_crc);
+      bool write_config_cache(uint32_t _file_crc);
+    #endif
+
     char * ip2str(uint32_t, char *_str, int _length);
     char * mac2str(byte _mac[], char *_str, int _length);
     bool str2ip(const char * _str, uint32_t * _ip);
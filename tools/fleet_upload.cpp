@@ -0,0 +1,870 @@
+// Fleet OTA orchestrator for Maison devices.
+//
+// Rolls out a new firmware to a list of devices through MQTT OTA (see the
+// MQTT OTA section of the Readme). Devices are updated in waves, with a limit
+// on the number of concurrent uploads. The device log and state topics are
+// monitored to follow each upload: a device is considered updated once it
+// reports "Code upload completed" and comes back with a STARTUP message (with
+// the expected application version, if supplied). Failed uploads are retried.
+//
+// Devices using deep sleep are flagged as sleepy in the device list. As they
+// connect to the broker with a persistent session, the NEW_CODE messages
+// (published with QOS 1) are held by the broker until they wake up. They are
+// not counted in the concurrent uploads limit until they report the start of
+// their upload, and a much longer timeout is used for them. A message queued
+// in a persistent session cannot be withdrawn by the publisher: when a sleepy
+// device times out before it woke up, the retry queues another copy of the
+// request. The device ignores a NEW_CODE for the code it is already running
+// and logs it with the MD5 of its code: when this MD5 is the one of the
+// rolled out code, the device is considered updated.
+//
+// Only the device log messages of the OTA process are followed: an upload
+// fails on the "Error: Code upload", "Error: Unsupported", "Error: SIZE, MD5"
+// and "Error: Wait for completion" messages, not on errors logged by the
+// application.
+//
+// With the -s option, the code is published only once, as retained chunks on
+// the shared topic <prefix>/ota/<APPLICATION_NAME>/<IMAGE_ID>/<index>, before
+// the rollout. The NEW_CODE message sent to each device then only references
+// the image: the devices pull and verify the chunks themselves, so the broker
+// load does not depend on the number of devices. Each chunk is the CRC-32 of
+// its data (as computed by Maison::CRC32(), 4 bytes little endian) followed by
+// the data. The chunk size must fit in the device MQTT_MAX_PACKET_SIZE, with
+// the topic name.
+//
+// The tool relies on the mosquitto_pub and mosquitto_sub command line tools.
+// Other commands with the same arguments can be used in their place with the
+// -P and -S options (e.g. a local stand-in to test a rollout, see
+// tools/test/test_fleet_upload.sh).
+//
+// Build: g++ -std=c++11 -O2 -pthread -o fleet_upload fleet_upload.cpp
+//
+// Usage: fleet_upload [options] <APPLICATION_NAME> <CODE_FILENAME> <DEVICE_LIST>
+//
+//   -h <host>     MQTT server (default: localhost)
+//   -p <port>     MQTT port (default: 8883)
+//   -u <user>     MQTT user name
+//   -k <password> MQTT password
+//   -c <cafile>   CA file. If present, TLS is used (without hostname check).
+//   -t <prefix>   Topic prefix, as MAISON_PREFIX_TOPIC (default: maison)
+//   -n <count>    Maximum concurrent uploads (default: 10)
+//   -w <count>    Devices per wave. 0 means a single wave (default: 0)
+//   -f <percent>  Stop before the next wave if the failure rate is above
+//                 this percentage (default: 100, never stop)
+//   -r <count>    Retries per device (default: 2)
+//   -d <seconds>  Delay before a retry (default: 30)
+//   -o <seconds>  Upload timeout for awake devices (default: 300)
+//   -l <seconds>  Wake up timeout for sleepy devices (default: 90000)
+//   -v <version>  Expected APP_VERSION once the device restarted
+//   -P <command>  Publish command (default: mosquitto_pub)
+//   -S <command>  Subscribe command (default: mosquitto_sub)
+//   -s <image_id> Publish the code once as a shared retained image
+//   -b <size>     Shared image chunk size in bytes (default: 512)
+//   -x            Remove the shared image from the broker at the end
+//
+// The device list contains one device id (the MAC address used in topics)
+// per line, optionally followed by the word "sleepy". Empty lines and lines
+// starting with # are ignored. For example:
+//
+//   DE01F3003571
+//   DE01F3003572 sleepy
+//
+// The exit status is 0 if all devices have been updated.
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+// ----- MD5 (RFC 1321) -----
+
+class MD5
+{
+  public:
+    MD5() : length(0), used(0) {
+      state[0] = 0x67452301; state[1] = 0xefcdab89;
+      state[2] = 0x98badcfe; state[3] = 0x10325476;
+    }
+
+    void add(const uint8_t * _data, size_t _size) {
+      length += _size;
+      while (_size--) {
+        block[used++] = *_data++;
+        if (used == 64) { transform(); used = 0; }
+      }
+    }
+
+    std::string hex_digest() {
+      uint64_t bits = length * 8;
+      uint8_t  pad  = 0x80;
+      add(&pad, 1);
+      pad = 0;
+      while (used != 56) add(&pad, 1);
+      for (int i = 0; i < 8; i++) block[56 + i] = (bits >> (8 * i)) & 0xff;
+      transform();
+
+      char str[33];
+      for (int i = 0; i < 16; i++) {
+        snprintf(&str[i * 2], 3, "%02x", (state[i >> 2] >> (8 * (i & 3))) & 0xff);
+      }
+      return std::string(str);
+    }
+
+  private:
+    uint32_t state[4];
+    uint64_t length;
+    uint8_t  block[64];
+    size_t   used;
+
+    static uint32_t rotl(uint32_t _x, int _c) { return (_x << _c) | (_x >> (32 - _c)); }
+
+    void transform() {
+      static const uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+      };
+      static const int r[64] = {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+        5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+      };
+
+      uint32_t w[16];
+      for (int i = 0; i < 16; i++) {
+        w[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+      }
+
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+      for (int i = 0; i < 64; i++) {
+        uint32_t f; int g;
+        if      (i < 16) { f = (b & c) | (~b & d); g = i;                }
+        else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) % 16; }
+        else if (i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) % 16; }
+        else             { f = c ^ (b | ~d);       g = (7 * i) % 16;     }
+        uint32_t tmp = d;
+        d = c;
+        c = b;
+        b = b + rotl(a + f + k[i] + w[g], r[i]);
+        a = tmp;
+      }
+
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    }
+};
+
+// ----- Devices and options -----
+
+enum class JobState { WAITING, PUBLISHING, SENT, STARTED, COMPLETED, SUCCESS, FAILED, SKIPPED };
+
+static const char * state_name(JobState _state)
+{
+  switch (_state) {
+    case JobState::WAITING:    return "WAITING";
+    case JobState::PUBLISHING: return "PUBLISHING";
+    case JobState::SENT:       return "SENT";
+    case JobState::STARTED:    return "STARTED";
+    case JobState::COMPLETED:  return "COMPLETED";
+    case JobState::SUCCESS:    return "SUCCESS";
+    case JobState::FAILED:     return "FAILED";
+    case JobState::SKIPPED:    return "SKIPPED";
+  }
+  return "?";
+}
+
+struct Device {
+  std::string id;
+  bool        sleepy;
+  int         wave;
+  JobState    state;
+  int         attempts;
+  double      retry_at;       // Times are in seconds since the beginning of the rollout
+  double      t_first;
+  double      t_published;
+  double      t_started;
+  double      t_completed;
+  double      t_done;
+  std::string throughput;     // As reported by the device, in KB/s
+  std::string message;        // Last error
+
+  Device(const std::string & _id, bool _sleepy) :
+    id(_id), sleepy(_sleepy), wave(0), state(JobState::WAITING), attempts(0),
+    retry_at(0), t_first(-1), t_published(-1), t_started(-1), t_completed(-1), t_done(-1) { }
+
+  bool active() const {
+    return (state == JobState::PUBLISHING) || (state == JobState::SENT) ||
+           (state == JobState::STARTED)    || (state == JobState::COMPLETED);
+  }
+
+  bool finished() const {
+    return (state == JobState::SUCCESS) || (state == JobState::FAILED) || (state == JobState::SKIPPED);
+  }
+};
+
+struct Options {
+  std::string host           = "localhost";
+  std::string port           = "8883";
+  std::string user;
+  std::string password;
+  std::string cafile;
+  std::string prefix         = "maison";
+  int         parallel       = 10;
+  int         wave_size      = 0;
+  int         max_failures   = 100;
+  int         retries        = 2;
+  int         retry_delay    = 30;
+  int         timeout        = 300;
+  int         sleepy_timeout = 90000;
+  std::string version;
+  std::string pub_cmd        = "mosquitto_pub";
+  std::string sub_cmd        = "mosquitto_sub";
+  std::string image_id;
+  int         chunk_size     = 512;
+  bool        remove_image   = false;
+};
+
+static Options              opts;
+static std::vector<Device>  devices;
+static std::mutex           devices_mutex;
+static std::atomic<bool>    interrupted(false);
+
+static const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+static double now()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+static void report(const Device & _dev, const char * _format, ...)
+{
+  char msg[512];
+
+  va_list args;
+  va_start(args, _format);
+  vsnprintf(msg, sizeof(msg), _format, args);
+  va_end(args);
+
+  printf("[%8.1f] %-14s %s\n", now(), _dev.id.c_str(), msg);
+  fflush(stdout);
+}
+
+// ----- MQTT client commands -----
+
+static std::vector<std::string> broker_args()
+{
+  std::vector<std::string> args = { "-h", opts.host, "-p", opts.port };
+
+  if (!opts.user.empty())     { args.push_back("-u"); args.push_back(opts.user);     }
+  if (!opts.password.empty()) { args.push_back("-P"); args.push_back(opts.password); }
+  if (!opts.cafile.empty()) {
+    args.push_back("--cafile"); args.push_back(opts.cafile);
+    args.push_back("--insecure");
+  }
+  return args;
+}
+
+static pid_t spawn(const std::string & _cmd, const std::vector<std::string> & _args, int * _out_fd)
+{
+  int fds[2];
+
+  if (_out_fd && (pipe(fds) != 0)) return -1;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (_out_fd) {
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+    }
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(_cmd.c_str()));
+    for (const std::string & arg : _args) argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(NULL);
+    execvp(argv[0], argv.data());
+    perror(_cmd.c_str());
+    _exit(127);
+  }
+
+  if (_out_fd) {
+    close(fds[1]);
+    if (pid < 0) close(fds[0]);
+    else *_out_fd = fds[0];
+  }
+  return pid;
+}
+
+// Launch a publish command. _kind is "-m" (message), "-f" (file content)
+// or "-n" (empty message, _data is ignored).
+
+static pid_t start_publish(const std::string & _topic, const char * _kind, const std::string & _data, bool _retain)
+{
+  std::vector<std::string> args = broker_args();
+  args.insert(args.end(), { "-q", "1", "-t", _topic, _kind });
+  if (strcmp(_kind, "-n") != 0) args.push_back(_data);
+  if (_retain) args.push_back("-r");
+
+  return spawn(opts.pub_cmd, args, NULL);
+}
+
+static bool publish_completed(pid_t _pid)
+{
+  int status;
+  if ((_pid < 0) || (waitpid(_pid, &status, 0) != _pid)) return false;
+  return WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+static bool publish(const std::string & _topic, const char * _kind, const std::string & _data, bool _retain = false)
+{
+  return publish_completed(start_publish(_topic, _kind, _data, _retain));
+}
+
+static std::string descriptor;
+static std::string code_filename;
+static std::string image_topic;   // Shared image chunks topic, without the chunk index
+static std::string code_md5;
+static int         chunk_count = 0;
+
+// ----- Shared image -----
+
+// Same algorithm as Maison::CRC32()
+
+static uint32_t crc32(const uint8_t * _data, size_t _length)
+{
+  uint32_t crc = 0xffffffff;
+
+  while (_length--) {
+    uint8_t c = *_data++;
+    for (uint32_t i = 0x80; i > 0; i >>= 1) {
+      bool bit = crc & 0x80000000;
+      if (c & i) bit = !bit;
+      crc <<= 1;
+      if (bit) crc ^= 0x04c11db7;
+    }
+  }
+  return crc;
+}
+
+// Publish (or remove, if _remove is true) the shared image chunks as retained 
+// messages, with up to opts.parallel concurrent publish commands.
+
+static bool publish_image(bool _remove)
+{
+  char dir[] = "/tmp/fleet_uploadXXXXXX";
+
+  if (!_remove && (mkdtemp(dir) == NULL)) return false;
+
+  FILE * file = _remove ? NULL : fopen(code_filename.c_str(), "rb");
+  if (!_remove && (file == NULL)) {
+    rmdir(dir);
+    return false;
+  }
+
+  std::vector<pid_t>       pids;
+  std::vector<std::string> files;
+  std::vector<uint8_t>     chunk(opts.chunk_size + 4);
+  int                      failures = 0;
+
+  for (int i = 0; (i < chunk_count) && !interrupted; i++) {
+    std::string topic = image_topic + std::to_string(i);
+    std::string chunk_file;
+
+    if (!_remove) {
+      size_t   size = fread(&chunk[4], 1, opts.chunk_size, file);
+      uint32_t crc  = crc32(&chunk[4], size);
+      for (int j = 0; j < 4; j++) chunk[j] = (crc >> (8 * j)) & 0xff;
+
+      chunk_file = std::string(dir) + "/" + std::to_string(i);
+      FILE * out = fopen(chunk_file.c_str(), "wb");
+      if ((out == NULL) || (fwrite(chunk.data(), 1, size + 4, out) != (size + 4))) failures++;
+      if (out != NULL) fclose(out);
+    }
+
+    if ((int) pids.size() >= opts.parallel) {
+      if (!publish_completed(pids.front())) failures++;
+      pids.erase(pids.begin());
+    }
+    pids.push_back(_remove ? start_publish(topic, "-n", "", true) :
+                             start_publish(topic, "-f", chunk_file, true));
+    files.push_back(chunk_file);
+
+    if (((i + 1) % 100) == 0) {
+      printf("%s %d of %d chunks\n", _remove ? "Removed" : "Published", i + 1, chunk_count);
+      fflush(stdout);
+    }
+  }
+
+  for (pid_t pid : pids) {
+    if (!publish_completed(pid)) failures++;
+  }
+
+  if (!_remove) {
+    fclose(file);
+    for (const std::string & name : files) unlink(name.c_str());
+    rmdir(dir);
+  }
+
+  if (failures > 0) fprintf(stderr, "Error: %d chunk(s) not published.\n", failures);
+  return (failures == 0) && !interrupted;
+}
+
+// ----- Rollout -----
+
+static void fail_attempt(Device & _dev, const std::string & _why)
+{
+  _dev.message = _why;
+  if (_dev.attempts <= opts.retries) {
+    report(_dev, "attempt %d failed (%s), retry in %d seconds", _dev.attempts, _why.c_str(), opts.retry_delay);
+    _dev.state    = JobState::WAITING;
+    _dev.retry_at = now() + opts.retry_delay;
+  }
+  else {
+    report(_dev, "FAILED after %d attempts (%s)", _dev.attempts, _why.c_str());
+    _dev.state  = JobState::FAILED;
+    _dev.t_done = now();
+  }
+}
+
+static void upload_job(size_t _idx)
+{
+  std::string topic;
+  {
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    topic = opts.prefix + "/" + devices[_idx].id + "/ctrl";
+  }
+
+  bool ok = publish(topic, "-m", descriptor) && 
+            (!image_topic.empty() || publish(topic, "-f", code_filename));
+
+  std::lock_guard<std::mutex> lock(devices_mutex);
+  Device & dev = devices[_idx];
+  if (dev.state != JobState::PUBLISHING) return;
+
+  if (ok) {
+    dev.state       = JobState::SENT;
+    dev.t_published = now();
+    report(dev, dev.sleepy ? "code queued, waiting for the device to wake up" : "code sent");
+  }
+  else {
+    fail_attempt(dev, "unable to publish");
+  }
+}
+
+static std::string json_string(const std::string & _json, const char * _key)
+{
+  std::string pattern = std::string("\"") + _key + "\":\"";
+  size_t pos = _json.find(pattern);
+  if (pos == std::string::npos) return "";
+  pos += pattern.size();
+  size_t end = _json.find('"', pos);
+  return (end == std::string::npos) ? "" : _json.substr(pos, end - pos);
+}
+
+// The log messages of a failed OTA upload, as sent by the device
+
+static bool is_ota_error(const std::string & _text)
+{
+  static const char * errors[] = {
+    "Error: Code upload",
+    "Error: Unsupported",
+    "Error: SIZE, MD5",
+    "Error: Wait for completion"
+  };
+
+  for (const char * error : errors) {
+    if (_text.compare(0, strlen(error), error) == 0) return true;
+  }
+  return false;
+}
+
+// Process a line received from the subscribe command: "<topic> <payload>"
+
+static void process_line(const std::string & _line)
+{
+  size_t space = _line.find(' ');
+  if (space == std::string::npos) return;
+
+  std::string topic   = _line.substr(0, space);
+  std::string payload = _line.substr(space + 1);
+
+  // <prefix>/<id>/<suffix>
+
+  if (topic.compare(0, opts.prefix.size() + 1, opts.prefix + "/") != 0) return;
+  size_t slash = topic.find('/', opts.prefix.size() + 1);
+  if (slash == std::string::npos) return;
+
+  std::string id     = topic.substr(opts.prefix.size() + 1, slash - opts.prefix.size() - 1);
+  std::string suffix = topic.substr(slash + 1);
+
+  std::lock_guard<std::mutex> lock(devices_mutex);
+
+  for (Device & dev : devices) {
+    if ((dev.id != id) || !dev.active()) continue;
+
+    if (suffix == "log") {
+      // Log messages are prefixed with the device name
+      size_t colon = payload.find(": ");
+      std::string text = (colon == std::string::npos) ? payload : payload.substr(colon + 2);
+
+      if (text.find("Code update started") == 0) {
+        dev.state     = JobState::STARTED;
+        dev.t_started = now();
+        report(dev, "upload started");
+      }
+      else if (text.find("Code upload completed") == 0) {
+        size_t open  = text.find('(');
+        size_t close = text.find(" KB/s");
+        if ((open != std::string::npos) && (close != std::string::npos) && (close > open)) {
+          dev.throughput = text.substr(open + 1, close - open - 1);
+        }
+        dev.state       = JobState::COMPLETED;
+        dev.t_completed = now();
+        report(dev, "upload completed, waiting for restart");
+      }
+      else if (text.find("Info: Code already running") == 0) {
+        // "Info: Code already running (md5: <md5>). Upload ignored."
+        size_t from = text.find("md5: ");
+        size_t to   = text.find(')');
+        if ((from != std::string::npos) && (to != std::string::npos) && (to > from) &&
+            (text.substr(from + 5, to - from - 5) == code_md5)) {
+          dev.state  = JobState::SUCCESS;
+          dev.t_done = now();
+          report(dev, "already running the code");
+        }
+      }
+      else if (is_ota_error(text)) {
+        fail_attempt(dev, text);
+      }
+    }
+    else if ((suffix == "state") && (json_string(payload, "msg_type") == "STARTUP")) {
+      std::string version = json_string(payload, "app_version");
+
+      if (dev.state != JobState::COMPLETED) {
+        fail_attempt(dev, "device restarted during upload");
+      }
+      else if (!opts.version.empty() && (version != opts.version)) {
+        fail_attempt(dev, "restarted with version " + version);
+      }
+      else {
+        dev.state  = JobState::SUCCESS;
+        dev.t_done = now();
+        report(dev, "updated, running version %s", version.c_str());
+      }
+    }
+  }
+}
+
+static void monitor(int _fd)
+{
+  FILE * in = fdopen(_fd, "r");
+  if (in == NULL) return;
+
+  std::string line;
+  int ch;
+  while ((ch = fgetc(in)) != EOF) {
+    if (ch == '\n') {
+      process_line(line);
+      line.clear();
+    }
+    else {
+      line += (char) ch;
+    }
+  }
+  fclose(in);
+}
+
+static void check_timeouts()
+{
+  double t = now();
+
+  for (Device & dev : devices) {
+    if ((dev.state == JobState::SENT) &&
+        ((t - dev.t_published) > (dev.sleepy ? opts.sleepy_timeout : opts.timeout))) {
+      fail_attempt(dev, dev.sleepy ? "device did not wake up" : "upload not started");
+    }
+    else if ((dev.state == JobState::STARTED) && ((t - dev.t_started) > opts.timeout)) {
+      fail_attempt(dev, "upload not completed");
+    }
+    else if ((dev.state == JobState::COMPLETED) && ((t - dev.t_completed) > opts.timeout)) {
+      fail_attempt(dev, "device did not restart");
+    }
+  }
+}
+
+// Start uploads of the current wave, up to the concurrent uploads limit.
+// Sleepy devices waiting to wake up are not counted.
+
+static void launch(int _wave, std::vector<std::thread> & _threads)
+{
+  int running = 0;
+
+  for (const Device & dev : devices) {
+    if (dev.active() && !(dev.sleepy && (dev.state == JobState::SENT))) running++;
+  }
+
+  double t = now();
+
+  for (size_t i = 0; i < devices.size(); i++) {
+    Device & dev = devices[i];
+
+    if ((dev.wave != _wave) || (dev.state != JobState::WAITING) || (dev.retry_at > t)) continue;
+    if (running >= opts.parallel) break;
+
+    dev.attempts++;
+    if (dev.t_first < 0) dev.t_first = t;
+    dev.t_started = dev.t_completed = -1;
+
+    dev.state = JobState::PUBLISHING;
+    report(dev, "attempt %d", dev.attempts);
+    _threads.push_back(std::thread(upload_job, i));
+    running++;
+  }
+}
+
+static std::string elapsed(double _from, double _to)
+{
+  char str[20];
+  if ((_from < 0) || (_to < 0)) return "-";
+  snprintf(str, sizeof(str), "%.1f", _to - _from);
+  return str;
+}
+
+static void final_report()
+{
+  int success = 0, failed = 0, skipped = 0;
+
+  printf("\n%-14s %-8s %8s %10s %10s %10s %10s %8s  %s\n",
+         "DEVICE", "RESULT", "ATTEMPTS", "WAIT(s)", "UPLOAD(s)", "RESTART(s)", "TOTAL(s)", "KB/s", "MESSAGE");
+
+  for (const Device & dev : devices) {
+    if      (dev.state == JobState::SUCCESS) success++;
+    else if (dev.state == JobState::SKIPPED) skipped++;
+    else                                     failed++;
+
+    printf("%-14s %-8s %8d %10s %10s %10s %10s %8s  %s\n",
+           dev.id.c_str(),
+           state_name(dev.state),
+           dev.attempts,
+           elapsed(dev.t_published, dev.t_started).c_str(),
+           elapsed(dev.t_started, dev.t_completed).c_str(),
+           elapsed(dev.t_completed, dev.t_done).c_str(),
+           elapsed(dev.t_first, dev.t_done).c_str(),
+           dev.throughput.empty() ? "-" : dev.throughput.c_str(),
+           (dev.state == JobState::SUCCESS) ? "" : dev.message.c_str());
+  }
+
+  printf("\n%d updated, %d failed, %d skipped, in %.1f seconds.\n", success, failed, skipped, now());
+}
+
+static bool load_devices(const char * _filename)
+{
+  std::ifstream file(_filename);
+  if (!file) return false;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream words(line);
+    std::string id, flag;
+    if (!(words >> id) || (id[0] == '#')) continue;
+    words >> flag;
+    devices.push_back(Device(id, flag == "sleepy"));
+  }
+  return true;
+}
+
+static bool build_descriptor(const char * _app_name, const char * _filename)
+{
+  FILE * file = fopen(_filename, "rb");
+  if (file == NULL) return false;
+
+  MD5     md5;
+  uint8_t buff[4096];
+  size_t  size = 0, count;
+
+  while ((count = fread(buff, 1, sizeof(buff), file)) > 0) {
+    md5.add(buff, count);
+    size += count;
+  }
+  fclose(file);
+
+  code_md5   = md5.hex_digest();
+  descriptor = std::string("NEW_CODE:{\"APP_NAME\":\"") + _app_name +
+               "\",\"SIZE\":" + std::to_string(size) +
+               ",\"MD5\":\"" + code_md5 + "\"";
+
+  if (!opts.image_id.empty()) {
+    chunk_count = (size + opts.chunk_size - 1) / opts.chunk_size;
+    image_topic = opts.prefix + "/ota/" + _app_name + "/" + opts.image_id + "/";
+    descriptor += ",\"IMAGE_ID\":\"" + opts.image_id +
+                  "\",\"CHUNKS\":" + std::to_string(chunk_count) +
+                  ",\"CHUNK_SIZE\":" + std::to_string(opts.chunk_size);
+  }
+  descriptor += "}";
+  return true;
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: fleet_upload [options] <APPLICATION_NAME> <CODE_FILENAME> <DEVICE_LIST>\n"
+                  "Please look at the source file header for the options description.\n");
+  exit(1);
+}
+
+static void on_signal(int) { interrupted = true; }
+
+int main(int argc, char ** argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "h:p:u:k:c:t:n:w:f:r:d:o:l:v:P:S:s:b:x")) != -1) {
+    switch (opt) {
+      case 'h': opts.host           = optarg;       break;
+      case 'p': opts.port           = optarg;       break;
+      case 'u': opts.user           = optarg;       break;
+      case 'k': opts.password       = optarg;       break;
+      case 'c': opts.cafile         = optarg;       break;
+      case 't': opts.prefix         = optarg;       break;
+      case 'n': opts.parallel       = atoi(optarg); break;
+      case 'w': opts.wave_size      = atoi(optarg); break;
+      case 'f': opts.max_failures   = atoi(optarg); break;
+      case 'r': opts.retries        = atoi(optarg); break;
+      case 'd': opts.retry_delay    = atoi(optarg); break;
+      case 'o': opts.timeout        = atoi(optarg); break;
+      case 'l': opts.sleepy_timeout = atoi(optarg); break;
+      case 'v': opts.version        = optarg;       break;
+      case 'P': opts.pub_cmd        = optarg;       break;
+      case 'S': opts.sub_cmd        = optarg;       break;
+      case 's': opts.image_id       = optarg;       break;
+      case 'b': opts.chunk_size     = atoi(optarg); break;
+      case 'x': opts.remove_image   = true;         break;
+      default:  usage();
+    }
+  }
+
+  if ((argc - optind) != 3) usage();
+  if (opts.parallel < 1) opts.parallel = 1;
+  if (opts.chunk_size < 1) usage();
+
+  code_filename = argv[optind + 1];
+
+  if (!build_descriptor(argv[optind], argv[optind + 1])) {
+    fprintf(stderr, "Error: Unable to read %s.\n", argv[optind + 1]);
+    return 1;
+  }
+  if (!load_devices(argv[optind + 2]) || devices.empty()) {
+    fprintf(stderr, "Error: Unable to read devices from %s.\n", argv[optind + 2]);
+    return 1;
+  }
+
+  int wave_size = (opts.wave_size > 0) ? opts.wave_size : devices.size();
+  int waves     = (devices.size() + wave_size - 1) / wave_size;
+  for (size_t i = 0; i < devices.size(); i++) devices[i].wave = i / wave_size;
+
+  printf("Descriptor: %s\n", descriptor.c_str());
+  printf("Rolling out to %zu devices in %d wave(s), %d concurrent uploads.\n",
+         devices.size(), waves, opts.parallel);
+
+  signal(SIGINT,  on_signal);
+  signal(SIGTERM, on_signal);
+
+  if (!image_topic.empty()) {
+    printf("Publishing shared image %s in %d chunks.\n", opts.image_id.c_str(), chunk_count);
+    if (!publish_image(false)) {
+      fprintf(stderr, "Error: Unable to publish the shared image.\n");
+      return 1;
+    }
+  }
+
+  // Start monitoring before sending anything, not to miss any answer
+
+  std::vector<std::string> args = broker_args();
+  args.insert(args.end(), { "-v", "-t", opts.prefix + "/+/log", "-t", opts.prefix + "/+/state" });
+
+  int   fd;
+  pid_t sub_pid = spawn(opts.sub_cmd, args, &fd);
+  if (sub_pid < 0) {
+    fprintf(stderr, "Error: Unable to launch %s.\n", opts.sub_cmd.c_str());
+    return 1;
+  }
+  std::thread monitor_thread(monitor, fd);
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+
+  std::vector<std::thread> threads;
+
+  for (int wave = 0; (wave < waves) && !interrupted; wave++) {
+    printf("---- Wave %d of %d ----\n", wave + 1, waves);
+
+    while (!interrupted) {
+      bool done = true;
+      {
+        std::lock_guard<std::mutex> lock(devices_mutex);
+        check_timeouts();
+        launch(wave, threads);
+        for (const Device & dev : devices) {
+          if ((dev.wave == wave) && !dev.finished()) done = false;
+        }
+      }
+      if (done) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    int finished = 0, failed = 0;
+    for (const Device & dev : devices) {
+      if (dev.finished()) finished++;
+      if (dev.state == JobState::FAILED) failed++;
+    }
+    if ((wave + 1 < waves) && (finished > 0) && ((failed * 100 / finished) > opts.max_failures)) {
+      printf("Failure rate of %d%% above %d%%. Rollout stopped.\n", failed * 100 / finished, opts.max_failures);
+      break;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(devices_mutex);
+    for (Device & dev : devices) {
+      if (!dev.finished()) {
+        if (interrupted && dev.active()) dev.message = "interrupted";
+        dev.state = (dev.active() || (dev.attempts > 0)) ? JobState::FAILED : JobState::SKIPPED;
+      }
+    }
+  }
+
+  for (std::thread & thread : threads) thread.join();
+
+  kill(sub_pid, SIGTERM);
+  waitpid(sub_pid, NULL, 0);
+  monitor_thread.join();
+
+  if (!image_topic.empty() && opts.remove_image) {
+    printf("Removing shared image %s.\n", opts.image_id.c_str());
+    interrupted = false;
+    publish_image(true);
+  }
+
+  final_report();
+
+  for (const Device & dev : devices) {
+    if (dev.state != JobState::SUCCESS) return 1;
+  }
+  return 0;
+}
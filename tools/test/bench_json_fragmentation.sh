@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+#
+# Builds and runs the JSON document heap fragmentation benchmark
+# (json_fragmentation.cpp) on the host.
+#
+# Usage: bench_json_fragmentation.sh [messages]
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/maison_benchXXXXXX)
+
+trap 'rm -rf "${WORK}"' EXIT
+
+g++ -std=gnu++11 -O1 -Wall -Wextra \
+    -I"${HERE}/host" -I"${HERE}/../../src" \
+    -o "${WORK}/json_fragmentation" "${HERE}/json_fragmentation.cpp" || exit 1
+"${WORK}/json_fragmentation" "$@"
@@ -0,0 +1,178 @@
+// Host stand-in for the ESP8266 Arduino core, used by the test harnesses
+// of tools/test. Only what the Maison library needs is declared. The heap
+// is simulated with a first-fit arena so that its fragmentation can be
+// observed as on the device.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <new>
+
+#include "host_heap.h"
+
+typedef uint8_t byte;
+
+class __FlashStringHelper;
+
+#define F(s)   (reinterpret_cast<const __FlashStringHelper *>(s))
+#define PSTR(s) (s)
+#define PROGMEM
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+
+#define FLASH_SECTOR_SIZE 4096
+
+#define HIGH         1
+#define LOW          0
+#define INPUT        0
+#define OUTPUT       1
+#define INPUT_PULLUP 2
+#define RISING       1
+#define FALLING      2
+#define CHANGE       3
+
+#define digitalPinToInterrupt(p) (p)
+#define noInterrupts()
+#define interrupts()
+
+#define vsnprintf_P vsnprintf
+#define snprintf_P  snprintf
+#define strlen_P    strlen
+#define memcpy_P    memcpy
+#define strncmp_P   strncmp
+#define strcmp_P    strcmp
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+inline size_t strlcpy(char * d, const char * s, size_t n)
+{
+  size_t l = strlen(s);
+  if (n) { size_t c = (l < n - 1) ? l : n - 1; memcpy(d, s, c); d[c] = 0; }
+  return l;
+}
+
+inline size_t strlcat(char * d, const char * s, size_t n)
+{
+  size_t l = strlen(d);
+  return l + strlcpy(d + l, s, (n > l) ? n - l : 0);
+}
+
+inline char * itoa(int v, char * s, int)      { sprintf(s, "%d", v); return s; }
+inline char * utoa(unsigned v, char * s, int) { sprintf(s, "%u", v); return s; }
+
+class String {
+  public:
+    String() {}
+    String(const char *) {}
+    const char * c_str() const { return ""; }
+    void trim() {}
+    unsigned length() const { return 0; }
+};
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t * b, size_t n) { size_t r = 0; while (n--) r += write(*b++); return r; }
+    template<class T> size_t print(T)        { return 0; }
+    template<class T> size_t print(T, int)   { return 0; }
+    template<class T> size_t println(T)      { return 0; }
+    size_t println()                         { return 0; }
+    virtual void flush() {}
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    size_t readBytes(uint8_t *, size_t) { return 0; }
+    size_t readBytes(char *, size_t)    { return 0; }
+};
+
+struct HardwareSerial : public Stream {
+  size_t write(uint8_t) { return 1; }
+  using Print::write;
+  int available() { return 0; }
+  int read()      { return 0; }
+  int peek()      { return 0; }
+  void begin(long) {}
+};
+
+extern HardwareSerial Serial;
+
+// Time only moves forward when the code waits.
+
+extern unsigned long host_clock_us;
+
+inline unsigned long micros()                 { return host_clock_us; }
+inline unsigned long millis()                 { return host_clock_us / 1000; }
+inline void delay(unsigned long ms)           { host_clock_us += 1000 * ms; }
+inline void delayMicroseconds(unsigned int us) { host_clock_us += us; }
+inline void yield() {}
+
+inline int  digitalRead(uint8_t)           { return HIGH; }
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline void pinMode(uint8_t, uint8_t)      {}
+inline void attachInterrupt(uint8_t, void (*)(void), int) {}
+inline void attachInterruptArg(uint8_t, void (*)(void *), void *, int) {}
+inline void detachInterrupt(uint8_t) {}
+
+struct rst_info { uint32_t reason; };
+
+enum rst_reason {
+  REASON_DEFAULT_RST = 0, REASON_WDT_RST, REASON_EXCEPTION_RST, REASON_SOFT_WDT_RST,
+  REASON_SOFT_RESTART, REASON_DEEP_SLEEP_AWAKE, REASON_EXT_SYS_RST
+};
+
+enum RFMode { RF_DEFAULT = 0, RF_CAL = 1, RF_NO_CAL = 2, RF_DISABLED = 4 };
+
+#define WAKE_RF_DEFAULT  RF_DEFAULT
+#define WAKE_RF_DISABLED RF_DISABLED
+#define WAKE_NO_RFCAL    RF_NO_CAL
+
+class EspClass {
+  public:
+    uint16_t getVcc() { return 3300; }
+    rst_info * getResetInfoPtr() { static rst_info info = { REASON_DEFAULT_RST }; return &info; }
+    bool rtcUserMemoryRead(uint32_t, uint32_t *, size_t)  { return false; }
+    bool rtcUserMemoryWrite(uint32_t, uint32_t *, size_t) { return true; }
+    void deepSleep(uint64_t, RFMode = RF_DEFAULT) {}
+    uint64_t deepSleepMax() { return 3 * 3600ULL * 1000000ULL; }
+    void restart() {}
+    uint32_t getFreeHeap() { return host_heap_free(); }
+    uint16_t getMaxFreeBlockSize() { return host_heap_max_block(); }
+    uint8_t getHeapFragmentation() { return host_heap_fragmentation(); }
+    void getHeapStats(uint32_t * f, uint16_t * m, uint8_t * r) { *f = getFreeHeap(); *m = getMaxFreeBlockSize(); *r = getHeapFragmentation(); }
+    void getHeapStats(uint32_t * f, uint32_t * m, uint8_t * r) { *f = getFreeHeap(); *m = getMaxFreeBlockSize(); *r = getHeapFragmentation(); }
+    String getSketchMD5() { return String(); }
+    uint32_t getSketchSize() { return 0; }
+    uint32_t getFreeSketchSpace() { return 0; }
+    bool flashRead(uint32_t, uint32_t *, size_t) { return false; }
+    uint32_t getChipId() { return 0; }
+    uint32_t getCycleCount() { return (uint32_t) host_clock_us * 80; }
+};
+
+extern EspClass ESP;
+
+class UpdaterClass {
+  public:
+    bool begin(size_t, int = 0) { return false; }
+    bool setMD5(const char *) { return false; }
+    size_t write(uint8_t *, size_t) { return 0; }
+    bool end(bool = false) { return false; }
+    uint8_t getError() { return 0; }
+    void printError(Print &) {}
+    size_t size() { return 0; }
+    size_t progress() { return 0; }
+    bool isRunning() { return false; }
+    const char * md5String() { return ""; }
+};
+
+extern UpdaterClass Update;
@@ -0,0 +1,90 @@
+// Host stand-in for ArduinoJson: documents are always empty and parsing
+// always fails. The harnesses set the configuration directly. As with the
+// library, a DynamicJsonDocument allocates its capacity on the heap.
+
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+class JsonArray;
+class JsonObject;
+
+class JsonVariant {
+  public:
+    template<class T> T as() const { return T(); }
+    template<class T> bool is() const { return false; }
+    JsonVariant operator[](const char *) const { return JsonVariant(); }
+    JsonVariant operator[](int) const { return JsonVariant(); }
+    template<class T> JsonVariant & operator=(const T &) { return *this; }
+    bool isNull() const { return true; }
+    template<class T> bool set(const T &) { return true; }
+    template<class T> operator T() const { return T(); }
+    JsonArray createNestedArray(const char * = 0) const;
+    size_t size() const { return 0; }
+};
+
+class JsonArray  : public JsonVariant { public: template<class T> bool add(const T &) { return true; } };
+class JsonObject : public JsonVariant { public: bool containsKey(const char *) const { return false; } void remove(const char *) {} };
+
+class JsonPair {
+  public:
+    const char * key() const { return ""; }
+    JsonVariant value() const { return JsonVariant(); }
+};
+
+inline JsonArray JsonVariant::createNestedArray(const char *) const { return JsonArray(); }
+
+class JsonDocument {
+  public:
+    template<class T> T as() const { return T(); }
+    JsonVariant operator[](const char *) { return JsonVariant(); }
+    JsonArray createNestedArray(const char *) { return JsonArray(); }
+    bool containsKey(const char *) const { return false; }
+    void clear() {}
+    size_t capacity() const { return 0; }
+    size_t memoryUsage() const { return 0; }
+    void garbageCollect() {}
+    template<class T> T to() { return T(); }
+};
+
+class DynamicJsonDocument : public JsonDocument {
+  public:
+    explicit DynamicJsonDocument(size_t _capacity) : pool(host_malloc(_capacity)), size(pool ? _capacity : 0) {}
+    ~DynamicJsonDocument() { host_free(pool); }
+    size_t capacity() const { return size; }
+
+  private:
+    DynamicJsonDocument(const DynamicJsonDocument &);
+    DynamicJsonDocument & operator=(const DynamicJsonDocument &);
+
+    void * pool;
+    size_t size;
+};
+template<size_t N> class StaticJsonDocument : public JsonDocument { public: size_t capacity() const { return N; } };
+
+class DeserializationError {
+  public:
+    enum Code { Ok, NoMemory, InvalidInput, IncompleteInput, TooDeep };
+    DeserializationError(Code c = Ok) : c_(c) {}
+    operator bool() const { return c_ != Ok; }
+    const char * c_str() const { return "InvalidInput"; }
+    Code code() const { return c_; }
+  private:
+    Code c_;
+};
+
+inline DeserializationError deserializeJson(JsonDocument &, const char *)            { return DeserializationError::InvalidInput; }
+inline DeserializationError deserializeJson(JsonDocument &, char *)                  { return DeserializationError::InvalidInput; }
+inline DeserializationError deserializeJson(JsonDocument &, const char *, size_t)    { return DeserializationError::InvalidInput; }
+inline DeserializationError deserializeJson(JsonDocument &, char *, size_t)          { return DeserializationError::InvalidInput; }
+inline DeserializationError deserializeJson(JsonDocument &, const uint8_t *, size_t) { return DeserializationError::InvalidInput; }
+inline DeserializationError deserializeJson(JsonDocument &, Stream &)                { return DeserializationError::InvalidInput; }
+inline DeserializationError deserializeJson(JsonDocument &, File &)                  { return DeserializationError::InvalidInput; }
+
+inline size_t serializeJson(const JsonDocument &, Print &)         { return 0; }
+inline size_t serializeJson(const JsonDocument &, char * s, size_t) { *s = 0; return 0; }
+inline size_t measureJson(const JsonDocument &)                    { return 0; }
+
+template<class A, class B, size_t N> size_t copyArray(const A &, B (&)[N]) { return N; }
+template<class A, class B, size_t N> bool copyArray(A (&)[N], const B &)  { return true; }
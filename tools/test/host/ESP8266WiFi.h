@@ -0,0 +1,92 @@
+// Host stand-in for the ESP8266 WiFi library. The network clients
+// allocate their buffers from the simulated heap when connecting and
+// release them when stopped, as the ESP8266 core does. The test drives
+// the link and the broker through host_wifi_up, host_broker_up and
+// host_link_up.
+
+#pragma once
+
+#include <Arduino.h>
+
+typedef enum { WL_IDLE_STATUS = 0, WL_CONNECTED = 3, WL_DISCONNECTED = 6 } wl_status_t;
+
+enum WiFiMode_t      { WIFI_OFF = 0, WIFI_STA = 1 };
+enum WiFiSleepType_t { WIFI_NONE_SLEEP = 0, WIFI_LIGHT_SLEEP = 1, WIFI_MODEM_SLEEP = 2 };
+
+typedef enum { GPIO_PIN_INTR_LOLEVEL = 4, GPIO_PIN_INTR_HILEVEL = 5 } GPIO_INT_TYPE;
+
+inline void wifi_enable_gpio_wakeup(uint32_t, GPIO_INT_TYPE) {}
+
+extern bool host_wifi_up;    // The access point accepts the station
+extern bool host_broker_up;  // The broker accepts connections
+extern bool host_link_up;    // The current connection is still alive
+
+class IPAddress {
+  public:
+    IPAddress(uint32_t = 0) {}
+    operator uint32_t() const { return 0; }
+};
+
+class ESP8266WiFiClass {
+  public:
+    ESP8266WiFiClass() : joined(false) {}
+    wl_status_t status() { return (joined && host_wifi_up) ? WL_CONNECTED : WL_DISCONNECTED; }
+    bool mode(WiFiMode_t) { return true; }
+    bool config(IPAddress, IPAddress, IPAddress, IPAddress = IPAddress()) { return true; }
+    wl_status_t begin(const char *, const char *) { joined = true; return status(); }
+    IPAddress localIP() { return IPAddress(); }
+    uint8_t * macAddress(uint8_t * mac) { memset(mac, 0, 6); return mac; }
+    int32_t RSSI() { return -60; }
+    bool disconnect(bool = false) { joined = false; return true; }
+    bool setSleepMode(WiFiSleepType_t, uint8_t = 0) { return true; }
+    WiFiSleepType_t getSleepMode() { return WIFI_NONE_SLEEP; }
+    bool forceSleepBegin(uint32_t = 0) { return true; }
+    bool forceSleepWake() { return true; }
+    void persistent(bool) {}
+    bool setAutoReconnect(bool) { return true; }
+  private:
+    bool joined;
+};
+
+extern ESP8266WiFiClass WiFi;
+
+class Client : public Stream {
+  public:
+    virtual int connect(const char *, uint16_t) = 0;
+    virtual uint8_t connected() = 0;
+    virtual void stop() = 0;
+};
+
+class WiFiClient : public Client {
+  public:
+    static uint32_t constructed;
+
+    WiFiClient() : context(NULL) { constructed++; }
+    virtual ~WiFiClient() { WiFiClient::release(); }
+
+    size_t write(uint8_t) { return 1; }
+    using Print::write;
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+
+    // The TCP connection context is allocated when connecting, as lwIP does
+
+    int connect(const char *, uint16_t)
+    {
+      release();
+      if (!host_wifi_up || !host_broker_up) return 0;
+      context = host_malloc(160);
+      return context != NULL;
+    }
+
+    uint8_t connected() { return (context != NULL) && host_link_up; }
+    void stop() { release(); }
+    bool flush(unsigned) { return true; }
+    bool stop(unsigned) { release(); return true; }
+
+  protected:
+    virtual void release() { host_free(context); context = NULL; }
+
+    void * context;
+};
@@ -0,0 +1,37 @@
+// Host stand-in for the SPIFFS file system: there are no files.
+
+#pragma once
+
+#include <Arduino.h>
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File : public Stream {
+  public:
+    size_t write(uint8_t) { return 1; }
+    size_t write(const uint8_t *, size_t n) { return n; }
+    int available() { return 0; }
+    int read() { return -1; }
+    size_t read(uint8_t *, size_t) { return 0; }
+    int peek() { return -1; }
+    size_t size() const { return 0; }
+    size_t position() const { return 0; }
+    bool seek(uint32_t, SeekMode = SeekSet) { return false; }
+    void close() {}
+    operator bool() const { return false; }
+    const char * name() const { return ""; }
+};
+
+struct FSInfo { size_t totalBytes, usedBytes, blockSize, pageSize, maxOpenFiles, maxPathLength; };
+
+class FS {
+  public:
+    bool begin() { return true; }
+    File open(const char *, const char *) { return File(); }
+    bool exists(const char *) { return false; }
+    bool remove(const char *) { return false; }
+    bool rename(const char *, const char *) { return false; }
+    bool info(FSInfo & _info) { memset(&_info, 0, sizeof(_info)); return true; }
+};
+
+extern FS SPIFFS;
@@ -0,0 +1,62 @@
+// Host stand-in for PubSubClient. Publications and subscriptions succeed
+// as long as the network client is connected. As with the library, the
+// network client is stopped when the connection is found lost.
+
+#pragma once
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#ifndef MQTT_KEEPALIVE
+  #define MQTT_KEEPALIVE 15
+#endif
+
+#ifndef MQTT_MAX_PACKET_SIZE
+  #define MQTT_MAX_PACKET_SIZE 1024
+#endif
+
+#define MQTT_CALLBACK_SIGNATURE void (*callback)(char *, uint8_t *, unsigned int)
+
+class PubSubClient : public Print {
+  public:
+    PubSubClient() : client(NULL), session(false) {}
+
+    PubSubClient & setClient(Client & _client) { client = &_client; return *this; }
+    PubSubClient & setServer(const char * _server, uint16_t _port) { server = _server; port = _port; return *this; }
+    PubSubClient & setCallback(void (*)(const char *, uint8_t *, unsigned int)) { return *this; }
+    PubSubClient & setStream(Stream &) { return *this; }
+
+    bool connect(const char *, const char *, const char *, const char *, uint8_t, bool, const char *, bool)
+    {
+      session = (client != NULL) && client->connect(server, port);
+      return session;
+    }
+
+    void disconnect() { if (client != NULL) client->stop(); session = false; }
+    bool connected()
+    {
+      if (session && !client->connected()) {
+        client->stop();
+        session = false;
+      }
+      return session;
+    }
+
+    bool loop() { return connected(); }
+    int state() { return connected() ? 0 : -2; }
+
+    bool subscribe(const char *, uint8_t = 0) { return connected(); }
+    bool unsubscribe(const char *) { return connected(); }
+    bool publish(const char *, const char *) { return connected(); }
+    bool publish(const char *, const uint8_t *, unsigned int, bool = false) { return connected(); }
+    bool beginPublish(const char *, unsigned int, bool) { return connected(); }
+    int endPublish() { return connected(); }
+    size_t write(uint8_t) { return 1; }
+    size_t write(const uint8_t *, size_t _n) { return _n; }
+
+  private:
+    Client *     client;
+    const char * server;
+    uint16_t     port;
+    bool         session;
+};
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <Arduino.h>
+
+class StreamString : public Stream, public String {
+  public:
+    size_t write(uint8_t) { return 1; }
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    void flush() {}
+};
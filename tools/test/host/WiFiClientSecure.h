@@ -0,0 +1,61 @@
+// Host stand-in for the BearSSL client. As in the ESP8266 core, connect()
+// first frees the previous TLS context and buffers, then allocates the
+// context, the receive and the transmit buffers, in this order. They are
+// kept after a failed handshake, until stop() or the next connect().
+
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+struct br_ssl_client_context { uint8_t engine[3600]; };
+
+extern uint16_t host_max_fragment_length; // 0 if the broker doesn't support it
+extern bool     host_handshake_ok;        // The broker accepts the TLS handshake
+
+namespace BearSSL {
+
+  class WiFiClientSecure : public WiFiClient {
+    public:
+      WiFiClientSecure() : rx_size(16384), tx_size(512), sc(NULL), rx(NULL), tx(NULL) {}
+      ~WiFiClientSecure() { release(); }
+
+      bool setFingerprint(const uint8_t *) { return true; }
+      void setInsecure() {}
+      int getLastSSLError(char * = 0, size_t = 0) { return host_handshake_ok ? 0 : -1; }
+      void setBufferSizes(int _rx, int _tx) { rx_size = _rx; tx_size = _tx; }
+
+      static bool probeMaxFragmentLength(const char *, uint16_t, uint16_t _size)
+      {
+        return host_broker_up && (host_max_fragment_length != 0) && (_size >= host_max_fragment_length);
+      }
+
+      bool getMFLNStatus() { return host_max_fragment_length != 0; }
+
+      int connect(const char * _host, uint16_t _port)
+      {
+        release();
+        if (!WiFiClient::connect(_host, _port)) return 0;
+        sc = host_malloc(sizeof(br_ssl_client_context));
+        rx = host_malloc(rx_size);
+        tx = host_malloc(tx_size);
+        return (sc != NULL) && (rx != NULL) && (tx != NULL) && host_handshake_ok;
+      }
+
+      uint8_t connected() { return WiFiClient::connected() && (rx != NULL) && host_handshake_ok; }
+
+    protected:
+      void release()
+      {
+        host_free(sc); sc = NULL;
+        host_free(rx); rx = NULL;
+        host_free(tx); tx = NULL;
+        WiFiClient::release();
+      }
+
+    private:
+      int rx_size, tx_size;
+      void * sc;
+      void * rx;
+      void * tx;
+  };
+}
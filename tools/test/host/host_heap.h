@@ -0,0 +1,96 @@
+// First-fit heap arena of the host stand-in, sized like the heap left to
+// a sketch on the ESP8266. As with umm_malloc, a released block is merged
+// with its free neighbours.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#define HOST_HEAP_SIZE (48 * 1024)
+
+struct host_block { uint32_t size; uint32_t used; uint64_t pad; };
+
+extern uint8_t host_heap[HOST_HEAP_SIZE];
+extern bool    host_heap_ready;
+
+inline host_block * host_heap_first()
+{
+  host_block * b = (host_block *) host_heap;
+  if (!host_heap_ready) {
+    b->size = HOST_HEAP_SIZE - sizeof(host_block);
+    b->used = 0;
+    host_heap_ready = true;
+  }
+  return b;
+}
+
+inline host_block * host_heap_next(host_block * b)
+{
+  uint8_t * n = ((uint8_t *) b) + sizeof(host_block) + b->size;
+  return (n < host_heap + HOST_HEAP_SIZE) ? (host_block *) n : NULL;
+}
+
+inline void * host_malloc(size_t _size)
+{
+  _size = (_size + 15) & ~((size_t) 15);
+
+  for (host_block * b = host_heap_first(); b != NULL; b = host_heap_next(b)) {
+    if (b->used || (b->size < _size)) continue;
+    if (b->size >= _size + sizeof(host_block) + 16) {
+      host_block * rest = (host_block *) (((uint8_t *) b) + sizeof(host_block) + _size);
+      rest->size = b->size - _size - sizeof(host_block);
+      rest->used = 0;
+      b->size = _size;
+    }
+    b->used = 1;
+    return b + 1;
+  }
+
+  return NULL;
+}
+
+inline void host_free(void * _ptr)
+{
+  if (_ptr == NULL) return;
+
+  (((host_block *) _ptr) - 1)->used = 0;
+
+  for (host_block * b = host_heap_first(); b != NULL; b = host_heap_next(b)) {
+    host_block * n;
+    while (!b->used && ((n = host_heap_next(b)) != NULL) && !n->used) {
+      b->size += sizeof(host_block) + n->size;
+    }
+  }
+}
+
+inline uint32_t host_heap_free()
+{
+  uint32_t total = 0;
+  for (host_block * b = host_heap_first(); b != NULL; b = host_heap_next(b)) {
+    if (!b->used) total += b->size;
+  }
+  return total;
+}
+
+inline uint32_t host_heap_max_block()
+{
+  uint32_t largest = 0;
+  for (host_block * b = host_heap_first(); b != NULL; b = host_heap_next(b)) {
+    if (!b->used && (b->size > largest)) largest = b->size;
+  }
+  return largest;
+}
+
+// Same formula as the ESP8266 core: 100 - 100 * sqrt(sum(free^2)) / free
+
+inline uint8_t host_heap_fragmentation()
+{
+  double total = 0, squares = 0;
+  for (host_block * b = host_heap_first(); b != NULL; b = host_heap_next(b)) {
+    if (!b->used) { total += b->size; squares += (double) b->size * b->size; }
+  }
+  if (total == 0) return 0;
+  return (uint8_t) (100 - (100 * sqrt(squares)) / total);
+}
@@ -0,0 +1,174 @@
+// Heap fragmentation benchmark of the JSON document used to handle the
+// CONFIG and NEW_CODE control messages, run on the host with the stand-in
+// headers of tools/test/host.
+//
+// The same sequence of messages is run twice in the simulated heap: with a
+// DynamicJsonDocument(MAISON_JSON_DOC_SIZE) allocated for each message, as
+// the library did before, and with the statically allocated document it
+// now shares. As the static document takes its RAM from the heap on the
+// ESP8266, it is modelled by a block allocated first and never released.
+// While the messages are handled, the BearSSL context and buffers are
+// freed and allocated again, as the reconnections do, and long-lived
+// blocks are allocated: the OTA block and heatshrink window of a NEW_CODE,
+// the strings kept by the sketch after a CONFIG. The largest free block
+// and the fragmentation are reported for each run.
+//
+// Usage: json_fragmentation [messages]
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFiClientSecure.h>
+#include <Maison.h>
+
+alignas(16) uint8_t host_heap[HOST_HEAP_SIZE];
+bool                host_heap_ready = false;
+
+// Receive buffer of a broker without max fragment length support
+
+#define TLS_RX_SIZE 16384
+
+// Strings kept by the sketch, 32 to 543 bytes, the oldest one being
+// released when a new one is done.
+
+#define APP_BLOCKS 8
+
+// Number of messages an OTA upload lasts
+
+#define OTA_MESSAGES 3
+
+struct Run {
+  uint32_t min_block;   // Smallest largest free block after a message
+  uint8_t  max_frag;    // Largest fragmentation after a message
+  uint32_t last_block;
+  uint8_t  last_frag;
+  uint32_t failed;      // Failed allocations
+};
+
+static uint32_t next_draw(uint32_t & _seed, uint32_t _range)
+{
+  _seed = (_seed * 1103515245U) + 12345U;
+  return (_seed >> 16) % _range;
+}
+
+static void * allocate(size_t _size, Run & _run)
+{
+  void * ptr = host_malloc(_size);
+  if (ptr == NULL) _run.failed++;
+  return ptr;
+}
+
+struct Tls {
+  void * sc;
+  void * rx;
+  void * tx;
+};
+
+// What a reconnection does: the core frees the TLS context and buffers,
+// then allocates them again.
+
+static void reconnect(Tls & _tls, Run & _run)
+{
+  host_free(_tls.sc);
+  host_free(_tls.rx);
+  host_free(_tls.tx);
+  _tls.sc = allocate(sizeof(br_ssl_client_context), _run);
+  _tls.rx = allocate(TLS_RX_SIZE, _run);
+  _tls.tx = allocate(MAISON_TLS_TX_BUFFER_SIZE, _run);
+}
+
+static Run run(bool _dynamic, uint32_t _messages)
+{
+  static StaticJsonDocument<MAISON_JSON_DOC_SIZE> json_doc;
+
+  host_heap_ready = false; // Empty heap
+
+  Run      result    = { 0xFFFFFFFF, 0, 0, 0, 0 };
+  uint32_t seed      = 12345;
+  Tls      tls       = { NULL, NULL, NULL };
+  void *   app[APP_BLOCKS] = { NULL };
+  int      app_next  = 0;
+  void *   ota_block = NULL;
+  void *   window    = NULL;
+  uint32_t ota_left  = 0;
+
+  if (!_dynamic) allocate(MAISON_JSON_DOC_SIZE, result);
+
+  reconnect(tls, result);
+
+  for (uint32_t msg = 0; msg < _messages; msg++) {
+
+    // A reconnection before 20% of the messages
+
+    if (next_draw(seed, 5) == 0) reconnect(tls, result);
+
+    DynamicJsonDocument * doc = NULL;
+
+    if (_dynamic) {
+      doc = new DynamicJsonDocument(MAISON_JSON_DOC_SIZE);
+      if (doc->capacity() == 0) result.failed++;
+    }
+    else {
+      json_doc.clear();
+    }
+
+    if (next_draw(seed, 4) != 0) {
+
+      // CONFIG: the sketch keeps a string of the new configuration, and
+      // 25% of them change the broker settings, reconnecting.
+
+      host_free(app[app_next]);
+      app[app_next] = allocate(32 + next_draw(seed, 512), result);
+      app_next = (app_next + 1) % APP_BLOCKS;
+
+      if (next_draw(seed, 4) == 0) reconnect(tls, result);
+    }
+    else {
+
+      // NEW_CODE: the OTA block and window are allocated for the upload,
+      // a running one being abandoned.
+
+      host_free(ota_block);
+      host_free(window);
+      ota_block = allocate(OTA_BLOCK_SIZE, result);
+      window    = allocate(1 << OTA_MAX_WINDOW_BITS, result);
+      ota_left  = OTA_MESSAGES;
+    }
+
+    delete doc;
+
+    if ((ota_left > 0) && (--ota_left == 0)) {
+      host_free(ota_block);
+      host_free(window);
+      ota_block = window = NULL;
+    }
+
+    result.last_block = host_heap_max_block();
+    result.last_frag  = host_heap_fragmentation();
+
+    if (result.last_block < result.min_block) result.min_block = result.last_block;
+    if (result.last_frag  > result.max_frag)  result.max_frag  = result.last_frag;
+  }
+
+  return result;
+}
+
+static void report(const char * _name, const Run & _run)
+{
+  printf("%-22s %8u %8u %8u%% %8u%% %8u\n",
+         _name, _run.min_block, _run.last_block, _run.max_frag, _run.last_frag, _run.failed);
+}
+
+int main(int argc, char ** argv)
+{
+  uint32_t messages = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10000;
+
+  printf("%u CONFIG and NEW_CODE messages, %u bytes heap, JSON document of %u bytes\n\n",
+         messages, HOST_HEAP_SIZE, MAISON_JSON_DOC_SIZE);
+  printf("%-22s %17s %19s %8s\n", "", "largest block", "fragmentation", "failed");
+  printf("%-22s %8s %8s %9s %9s %8s\n", "document", "min", "last", "max", "last", "allocs");
+
+  report("DynamicJsonDocument", run(true,  messages));
+  report("static (shared)",     run(false, messages));
+
+  return 0;
+}
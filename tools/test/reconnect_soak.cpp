@@ -0,0 +1,163 @@
+// Reconnect soak test of the Maison MQTT connection, run on the host with
+// the stand-in headers of tools/test/host.
+//
+// The library source is compiled in this translation unit, with its
+// private members opened, and mqtt_connect() is called through a long
+// sequence of WiFi, broker, handshake and link failures. Between two
+// attempts, the application keeps allocating long-lived blocks of various
+// sizes, as a sketch does with its strings and documents while the network
+// is down. The test checks that no connection fails for lack of a free
+// block large enough for the TLS context and buffers: the reconnections
+// don't fragment the heap.
+//
+// Usage: reconnect_soak [cycles]
+
+#include <Arduino.h>
+#include <FS.h>
+#include <ESP8266WiFi.h>
+#include <WiFiClient.h>
+#include <WiFiClientSecure.h>
+#include <PubSubClient.h>
+#include <ArduinoJson.h>
+#include <StreamString.h>
+#include <core_version.h>
+#include <user_interface.h>
+
+// The library allocations are done in the simulated heap
+
+#define malloc(s) host_malloc(s)
+#define free(p)   host_free(p)
+
+#define private public
+#include "../../src/Maison.cpp"
+#undef private
+
+#undef malloc
+#undef free
+
+alignas(16) uint8_t host_heap[HOST_HEAP_SIZE];
+bool                host_heap_ready = false;
+
+unsigned long host_clock_us = 0;
+
+bool     host_wifi_up              = true;
+bool     host_broker_up            = true;
+bool     host_link_up              = true;
+bool     host_handshake_ok         = true;
+uint16_t host_max_fragment_length  = 0;
+uint32_t WiFiClient::constructed   = 0;
+
+HardwareSerial   Serial;
+EspClass         ESP;
+UpdaterClass     Update;
+ESP8266WiFiClass WiFi;
+FS               SPIFFS;
+
+void * operator new(size_t _size)
+{
+  void * ptr = host_malloc(_size);
+  if (ptr == NULL) throw std::bad_alloc();
+  return ptr;
+}
+
+void   operator delete(void * _ptr) noexcept         { host_free(_ptr); }
+void   operator delete(void * _ptr, size_t) noexcept { host_free(_ptr); }
+
+// Application blocks: a ring of long-lived allocations of 64 to 1063
+// bytes, the oldest one being released when a new one is done.
+
+#define APP_BLOCKS 36
+
+static void *   app_blocks[APP_BLOCKS];
+static int      app_next   = 0;
+static uint32_t app_failed = 0;
+
+static void app_allocate(uint32_t _size)
+{
+  host_free(app_blocks[app_next]);
+  app_blocks[app_next] = host_malloc(_size);
+  if (app_blocks[app_next] == NULL) app_failed++;
+  app_next = (app_next + 1) % APP_BLOCKS;
+}
+
+static int failures = 0;
+
+static void check(const char * _what, uint32_t _value, uint32_t _expected)
+{
+  if (_value == _expected) {
+    printf("PASS: %s\n", _what);
+  }
+  else {
+    printf("FAIL: %s (expected %u, got %u)\n", _what, _expected, _value);
+    failures++;
+  }
+}
+
+static uint32_t next_draw(uint32_t & _seed, uint32_t _range)
+{
+  _seed = (_seed * 1103515245U) + 12345U;
+  return (_seed >> 16) % _range;
+}
+
+int main(int argc, char ** argv)
+{
+  uint32_t cycles = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10000;
+  uint32_t seed   = 12345;
+
+  static Maison maison;
+
+  strlcpy(maison.config.device_name, "SOAK",           sizeof(maison.config.device_name));
+  strlcpy(maison.config.mqtt_server, "broker.example", sizeof(maison.config.mqtt_server));
+  maison.config.mqtt_port = 8883;
+
+  uint32_t connected = 0;
+  uint32_t refused   = 0; // Connections failed for lack of a large enough block
+  uint32_t max_free  = 0; // Largest free heap at such a failure
+  uint8_t  max_frag  = 0; // Largest fragmentation while connected
+
+  for (int i = 0; i < APP_BLOCKS; i++) app_allocate(64 + next_draw(seed, 1000));
+
+  for (uint32_t cycle = 0; cycle < cycles; cycle++) {
+
+    // 10% of the cycles without WiFi, 20% with the broker down, 10% with
+    // the TLS handshake rejected. The connection is lost at the end of
+    // every cycle.
+
+    uint32_t draw = next_draw(seed, 10);
+
+    host_wifi_up      = (draw != 0);
+    host_broker_up    = (draw >= 3);
+    host_handshake_ok = (draw != 3);
+    host_link_up      = true;
+
+    if (maison.mqtt_connect()) {
+      connected++;
+      maison.send_msg(MAISON_STATE_TOPIC, F("{\"cycle\":%u}"), cycle);
+
+      uint8_t frag = ESP.getHeapFragmentation();
+      if (frag > max_frag) max_frag = frag;
+    }
+    else if (draw >= 4) {
+      uint32_t free_heap = ESP.getFreeHeap();
+      if (free_heap > max_free) max_free = free_heap;
+      refused++;
+    }
+
+    host_link_up = false;
+    maison.mqtt_connected(); // Found lost by the loop()
+
+    // Until the next attempt, the application replaces one of its blocks
+
+    app_allocate(64 + next_draw(seed, 1000));
+  }
+
+  printf("%u cycles, %u connected, %u refused for memory (free heap <= %u), "
+         "%u application allocations failed, fragmentation <= %u%% while connected\n",
+         cycles, connected, refused, max_free, app_failed, max_frag);
+
+  check("network client constructed once", WiFiClient::constructed, 1);
+  check("no connection refused for memory", refused, 0);
+  check("some cycles connected", connected > 0, 1);
+
+  return (failures == 0) ? 0 : 1;
+}
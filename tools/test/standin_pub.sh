@@ -0,0 +1,99 @@
+#!/usr/bin/env bash
+#
+# Broker stand-in for tools/fleet_upload.cpp tests: replaces mosquitto_pub.
+#
+# Messages sent to a device ctrl topic are queued for it, as the broker does
+# for a persistent session. Simulated devices consume their queue and answer
+# on the bus file read by standin_sub.sh. The device behavior depends on its
+# id prefix:
+#
+#   OK*      Awake, updates successfully.
+#   BAD*     Awake, fails the first upload with an MD5 error.
+#   NOISY*   Awake, logs an application error, then updates successfully.
+#   CURRENT* Awake, already running the code.
+#   SLEEPY*  Wakes up STANDIN_WAKE seconds after the first message, then
+#            processes everything queued meanwhile.
+#
+# As the device does, a request for the code already running is ignored.
+#
+# Retained messages (shared image chunks) are stored in the retained
+# directory, and removed by an empty retained message.
+
+DIR=${STANDIN_DIR:-/tmp/maison_standin}
+WAKE=${STANDIN_WAKE:-3}
+
+while [[ $# -gt 0 ]]; do
+  case $1 in
+    -t) TOPIC=$2; shift ;;
+    -m) MSG=$2;   shift ;;
+    -f) FILE=$2;  shift ;;
+    -n) EMPTY=1 ;;
+    -r) RETAIN=1 ;;
+    -h|-p|-u|-P|-q|--cafile) shift ;;
+  esac
+  shift
+done
+
+mkdir -p "${DIR}/retained"
+
+if [[ -n "${RETAIN}" ]]; then
+  NAME=$(echo "${TOPIC}" | tr '/' '_')
+  if [[ -n "${EMPTY}" ]]; then
+    rm -f "${DIR}/retained/${NAME}"
+  else
+    cp "${FILE}" "${DIR}/retained/${NAME}"
+  fi
+  exit 0
+fi
+
+ID=$(echo "${TOPIC}" | cut -d/ -f2)
+
+# Only the NEW_CODE descriptors are queued, not the code streamed after them
+
+[[ "${MSG}" == NEW_CODE:* ]] || exit 0
+
+echo "${MSG}" >> "${DIR}/queue.${ID}"
+echo $(( $(cat "${DIR}/requests.${ID}" 2>/dev/null || echo 0) + 1 )) > "${DIR}/requests.${ID}"
+
+# One device process at a time, consuming the queue
+
+mkdir "${DIR}/awake.${ID}" 2>/dev/null || exit 0
+
+(
+  case ${ID} in
+    SLEEPY*) sleep "${WAKE}" ;;
+    *)       sleep 0.2 ;;
+  esac
+
+  while [[ -s "${DIR}/queue.${ID}" ]]; do
+    MD5=$(head -n 1 "${DIR}/queue.${ID}" | sed -n 's/.*"MD5":"\([0-9a-f]*\)".*/\1/p')
+    sed -i 1d "${DIR}/queue.${ID}"
+
+    [[ ${ID} == CURRENT* ]] && echo "${MD5}" > "${DIR}/md5.${ID}"
+
+    if [[ "${MD5}" == "$(cat "${DIR}/md5.${ID}" 2>/dev/null)" ]]; then
+      echo "maison/${ID}/log ${ID}: Info: Code already running (md5: ${MD5}). Upload ignored." >> "${DIR}/bus"
+      continue
+    fi
+
+    [[ ${ID} == NOISY* ]] && echo "maison/${ID}/log ${ID}: Error: Sensor not responding" >> "${DIR}/bus"
+
+    COUNT=$(( $(cat "${DIR}/uploads.${ID}" 2>/dev/null || echo 0) + 1 ))
+    echo ${COUNT} > "${DIR}/uploads.${ID}"
+
+    if [[ ${ID} == BAD* && ${COUNT} -eq 1 ]]; then
+      echo "maison/${ID}/log ${ID}: Error: Code upload not completed: MD5 Failed" >> "${DIR}/bus"
+      continue
+    fi
+    echo "maison/${ID}/log ${ID}: Code update started with size 1000 and md5: x." >> "${DIR}/bus"
+    sleep 0.3
+    echo "maison/${ID}/log ${ID}: Code upload completed: 1000 bytes received in 300 ms (3.3 KB/s). Rebooting" >> "${DIR}/bus"
+    echo "${MD5}" > "${DIR}/md5.${ID}"
+    sleep 0.2
+    echo "maison/${ID}/state {\"device\":\"${ID}\",\"msg_type\":\"STARTUP\",\"app_version\":\"1.0.4\"}" >> "${DIR}/bus"
+  done
+
+  rmdir "${DIR}/awake.${ID}"
+) > /dev/null 2>&1 &
+
+exit 0
@@ -0,0 +1,10 @@
+#!/usr/bin/env bash
+#
+# Broker stand-in for tools/fleet_upload.cpp tests: replaces mosquitto_sub.
+# Outputs the messages of the simulated devices (see standin_pub.sh) as
+# "mosquitto_sub -v" would.
+
+DIR=${STANDIN_DIR:-/tmp/maison_standin}
+
+touch "${DIR}/bus"
+exec tail -n 0 -F "${DIR}/bus" 2>/dev/null
@@ -0,0 +1,59 @@
+#!/usr/bin/env bash
+#
+# Runs tools/fleet_upload.cpp against the broker stand-in (standin_pub.sh
+# and standin_sub.sh) and checks the outcome of each simulated device.
+#
+# Usage: test_fleet_upload.sh
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+export STANDIN_DIR=$(mktemp -d /tmp/maison_standinXXXXXX)
+export STANDIN_WAKE=3
+
+TOOL=${STANDIN_DIR}/fleet_upload
+FAILURES=0
+
+trap 'rm -rf "${STANDIN_DIR}"' EXIT
+
+check() {
+  if [[ "$2" == "$3" ]]; then
+    echo "PASS: $1"
+  else
+    echo "FAIL: $1 (expected $3, got $2)"
+    FAILURES=$((FAILURES + 1))
+  fi
+}
+
+uploads() {
+  cat "${STANDIN_DIR}/uploads.$1" 2>/dev/null || echo 0
+}
+
+g++ -std=c++11 -O2 -pthread -o "${TOOL}" "${HERE}/../fleet_upload.cpp" || exit 1
+
+head -c 5000 /dev/urandom > "${STANDIN_DIR}/code.bin"
+printf "OK01\nBAD01\nNOISY01\nCURRENT01\nSLEEPY01 sleepy\n" > "${STANDIN_DIR}/devices"
+
+# The sleepy device wakes up after its first timeout (-l 1): the retry
+# queues a second copy of the request, ignored once the device is updated.
+
+"${TOOL}" -P "${HERE}/standin_pub.sh" -S "${HERE}/standin_sub.sh" \
+          -r 2 -d 1 -o 10 -l 1 -v 1.0.4 -s v1 -b 512 -x \
+          BLINKER "${STANDIN_DIR}/code.bin" "${STANDIN_DIR}/devices" > "${STANDIN_DIR}/out"
+STATUS=$?
+
+sleep 1
+
+check "rollout exit status"                ${STATUS} 0
+check "awake device uploads"               $(uploads OK01) 1
+check "device failing once uploads"        $(uploads BAD01) 2
+check "application error ignored"        $(uploads NOISY01) 1
+check "device already updated uploads"     $(uploads CURRENT01) 0
+check "sleepy device requests"             "$(cat "${STANDIN_DIR}/requests.SLEEPY01")" 2
+check "sleepy device uploads"              $(uploads SLEEPY01) 1
+check "updated devices"                    "$(grep -c ' SUCCESS ' "${STANDIN_DIR}/out")" 5
+check "shared image removed"               "$(ls "${STANDIN_DIR}/retained" | wc -l)" 0
+
+if [[ ${FAILURES} -ne 0 ]]; then
+  cat "${STANDIN_DIR}/out"
+  exit 1
+fi
+exit 0
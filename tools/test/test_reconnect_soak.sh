@@ -0,0 +1,22 @@
+#!/usr/bin/env bash
+#
+# Builds and runs the reconnect soak test (reconnect_soak.cpp) on the host,
+# with and without TLS.
+#
+# Usage: test_reconnect_soak.sh [cycles]
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/maison_soakXXXXXX)
+FAILURES=0
+
+trap 'rm -rf "${WORK}"' EXIT
+
+for SECURE in 1 0; do
+  echo "MAISON_SECURE=${SECURE}"
+  g++ -std=gnu++11 -O1 -Wall -Wextra -DMAISON_SECURE=${SECURE} \
+      -I"${HERE}/host" -I"${HERE}/../../src" \
+      -o "${WORK}/reconnect_soak" "${HERE}/reconnect_soak.cpp" || exit 1
+  "${WORK}/reconnect_soak" "$@" || FAILURES=$((FAILURES + 1))
+done
+
+exit $((FAILURES != 0))
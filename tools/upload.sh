@@ -2,15 +2,38 @@
 #
 # Example tool to upload a binary code through MQTT OTA as defined in maison.
 #
-# Usage: upload <DEVICE_ID> <APPLICATION_NAME> <CODE_FILENAME>
+# Usage: upload [-z] [-d <BASE_FILENAME>] <DEVICE_ID> <APPLICATION_NAME> <CODE_FILENAME>
+#
+#   -z  Compress the code with heatshrink before transmission. The heatshrink
+#       command line tool (https://github.com/atomicobject/heatshrink) must
+#       be available in the PATH.
+#
+#   -d  Send a delta against BASE_FILENAME, the code currently running on the
+#       device, instead of the whole code. The bsdiff tool from
+#       https://github.com/mendsley/bsdiff (ENDSLEY/BSDIFF43 format) and
+#       bunzip2 must be available in the PATH.
 #
 # Example: upload DE01F3003571 SONOFF firmware.bin
 #
 # To use it, you must setup the proper definitions below:
 #
 
+USAGE="Usage: upload [-z] [-d <BASE_FILENAME>] <DEVICE_ID> <APPLICATION_NAME> <CODE_FILENAME>"
+COMPRESS=0
+BASEFILE=""
+
+while getopts "zd:" opt; do
+  case ${opt} in
+    z) COMPRESS=1 ;;
+    d) BASEFILE="${OPTARG}" ;;
+    *) echo "${USAGE}"
+       exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
 if [[ $# -ne 3 ]]; then
-  echo "Usage: upload <DEVICE_ID> <APPLICATION_NAME> <CODE_FILENAME>"
+  echo "${USAGE}"
   exit 1
 fi
 
@@ -25,11 +48,19 @@ PSW="mqtt_password"
 CAFILE="your_cafile.crt"
 TOPIC="maison/$1/ctrl"
 
+# Heatshrink parameters. The device allocates a window of 2^HS_WINDOW bytes
+# (HS_WINDOW must not be greater than OTA_MAX_WINDOW_BITS).
+
+HS_WINDOW=10
+HS_LOOKAHEAD=5
+
 BINFILE="`ls \"$3\"`"
 if [[ "$OSTYPE" == "linux-gnu" ]]; then
+  MD5SUM="md5sum"
   DIGEST="`md5sum \"${BINFILE}\" | cut -d ' ' -f 1`"
   SIZE="`stat --printf \%s \"${BINFILE}\"`"
 elif [[ "$OSTYPE" == "darwin"* ]]; then
+  MD5SUM="md5 -r"
   DIGEST="`md5 -q \"${BINFILE}\"`"
   SIZE="`stat -f \%z \"${BINFILE}\"`"
 else
@@ -37,13 +68,48 @@ else
   exit 1
 fi
 
-DESCRIPTOR="NEW_CODE:{\"APP_NAME\":\"$2\",\"SIZE\":${SIZE},\"MD5\":\"${DIGEST}\"}"
+# SIZE and MD5 are always related to the resulting code: the device
+# checks them once the delta applied and the stream decompressed.
+
+DESCRIPTOR="NEW_CODE:{\"APP_NAME\":\"$2\",\"SIZE\":${SIZE},\"MD5\":\"${DIGEST}\""
+XMITFILE="${BINFILE}"
+TMPDIR="`mktemp -d`"
+trap 'rm -rf "${TMPDIR}"' EXIT
+
+if [[ -n "${BASEFILE}" ]]; then
+  BASE_DIGEST="`${MD5SUM} \"${BASEFILE}\" | cut -d ' ' -f 1`"
+  if ! bsdiff "${BASEFILE}" "${BINFILE}" "${TMPDIR}/patch.bz2"; then
+    echo "Error: Unable to compute the delta from ${BASEFILE}."
+    exit 1
+  fi
+  if [[ "`head -c 16 \"${TMPDIR}/patch.bz2\"`" != "ENDSLEY/BSDIFF43" ]]; then
+    echo "Error: bsdiff did not produce an ENDSLEY/BSDIFF43 patch."
+    exit 1
+  fi
+  # The device expects the patch without its bzip2 compression
+  { head -c 24 "${TMPDIR}/patch.bz2"; tail -c +25 "${TMPDIR}/patch.bz2" | bunzip2; } > "${TMPDIR}/patch"
+  DESCRIPTOR="${DESCRIPTOR},\"DELTA\":\"BSDIFF43\",\"BASE_MD5\":\"${BASE_DIGEST}\""
+  XMITFILE="${TMPDIR}/patch"
+  echo Delta size: `wc -c < "${XMITFILE}"` bytes vs ${SIZE}.
+fi
+
+if [[ ${COMPRESS} -eq 1 ]]; then
+  if ! heatshrink -e -w ${HS_WINDOW} -l ${HS_LOOKAHEAD} "${XMITFILE}" "${TMPDIR}/code.hs"; then
+    echo "Error: Unable to compress ${XMITFILE}."
+    exit 1
+  fi
+  DESCRIPTOR="${DESCRIPTOR},\"COMPRESSION\":\"HEATSHRINK\",\"WINDOW\":${HS_WINDOW},\"LOOKAHEAD\":${HS_LOOKAHEAD}"
+  XMITFILE="${TMPDIR}/code.hs"
+  echo Compressed size: `wc -c < "${XMITFILE}"` bytes vs ${SIZE}.
+fi
+
+DESCRIPTOR="${DESCRIPTOR}}"
 
 echo Uploading file ${BINFILE} through server ${MQTT_SERVER} with topic ${TOPIC}.
 echo Descriptor: ${DESCRIPTOR}.
 
 mosquitto_pub -p ${MQTT_PORT} -t "${TOPIC}" --insecure -h "${MQTT_SERVER}" -u ${USER} -P "${PSW}" --cafile "${CAFILE}" -m "${DESCRIPTOR}" -q 1
-mosquitto_pub -p ${MQTT_PORT} -t "${TOPIC}" --insecure -h "${MQTT_SERVER}" -u ${USER} -P "${PSW}" --cafile "${CAFILE}" -f "${BINFILE}" -q 1
+mosquitto_pub -p ${MQTT_PORT} -t "${TOPIC}" --insecure -h "${MQTT_SERVER}" -u ${USER} -P "${PSW}" --cafile "${CAFILE}" -f "${XMITFILE}" -q 1
 
 exit 0
 